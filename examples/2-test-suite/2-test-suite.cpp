@@ -25,6 +25,9 @@ enum {
 	TEST_RESUME_PUBLISING, // 6 resume publishing
 	TEST_PUBLISH_OFFLINE_RESET, // 7 go offline, publish some events, reset device, number is param0, optional size in param2
     TEST_CLEAR_QUEUES, // 8 clear circular buffer
+    TEST_WEAR_STATS, // 9 log wear and write amplification statistics
+    TEST_ENQUEUE_STATS, // 10 log enqueue latency statistics
+    TEST_DRAIN_ORDER, // 11 set drain order, 0 = oldest first, 1 = newest first, number of live events is param1
 };
 
 // Example:
@@ -196,6 +199,36 @@ int testHandler(String cmd) {
         PublishQueueSpiFlashRK::instance().clearQueues();
         break;
 
+    case TEST_WEAR_STATS:
+        {
+            PublishQueueSpiFlashRK::WearStats stats;
+            if (PublishQueueSpiFlashRK::instance().getWearStats(stats)) {
+                Log.info("TEST_WEAR_STATS sectors=%u sectorErases=%lu eraseCount=%lu metadataEraseCount=%lu", 
+                    stats.numSectors, stats.sectorErases, stats.eraseCount, stats.metadataEraseCount);
+                Log.info("userBytes=%lu flashBytes=%lu writeAmplification=%.2f observedSecs=%lu projectedLifetimeDays=%.1f", 
+                    (unsigned long)stats.userBytes, (unsigned long)stats.flashBytes, stats.writeAmplification, 
+                    stats.observedSecs, stats.projectedLifetimeDays);
+            }
+        }
+        break;
+
+    case TEST_DRAIN_ORDER:
+        Log.info("TEST_DRAIN_ORDER newestFirst=%d liveEvents=%d", intParam[0], intParam[1]);
+        PublishQueueSpiFlashRK::instance().withDrainOrder(
+            (intParam[0] ? PublishQueueSpiFlashRK::DrainOrder::NEWEST_FIRST : PublishQueueSpiFlashRK::DrainOrder::OLDEST_FIRST),
+            (intParam[1] > 0) ? intParam[1] : 10);
+        break;
+
+    case TEST_ENQUEUE_STATS:
+        {
+            PublishQueueSpiFlashRK::EnqueueStats stats;
+            PublishQueueSpiFlashRK::instance().getEnqueueStats(stats);
+            Log.info("TEST_ENQUEUE_STATS count=%lu staged=%lu p50=%lu p99=%lu max=%lu corrupt=%lu", 
+                stats.count, stats.stagedCount, stats.p50Micros, stats.p99Micros, stats.maxMicros,
+                PublishQueueSpiFlashRK::instance().getCorruptEvents());
+        }
+        break;
+
 	default:
 		testNum = tempTestNum;
 		break;
@@ -0,0 +1,61 @@
+#include "Particle.h"
+
+#include "PublishQueueSpiFlashStaticRK.h"
+
+SYSTEM_THREAD(ENABLED);
+
+SerialLogHandler logHandler(LOG_LEVEL_INFO, { // Logging level for non-application messages
+	{ "app.pubq", LOG_LEVEL_TRACE }
+});
+
+// Pick a chip, port, and CS line
+// SpiFlashISSI spiFlash(SPI, A2);
+// SpiFlashWinbond spiFlash(SPI, A4);
+SpiFlashMacronix spiFlash(SPI, A4);
+// SpiFlashWinbond spiFlash(SPI1, D5);
+
+// Limit events to 256 bytes of data to reduce the RAM used by the queue
+struct QueueConfig : public PublishQueueSpiFlashStaticConfig {
+    static constexpr size_t maxEventDataSize = 256;
+};
+PublishQueueSpiFlashStaticRK<QueueConfig> publishQueue;
+
+const std::chrono::milliseconds publishPeriod = 1min;
+unsigned long lastPublish = 0;
+int counter = 0;
+
+void publishCounter();
+
+
+void setup() {
+	// For testing purposes, wait 10 seconds before continuing to allow serial to connect
+	// before doing PublishQueue setup so the debug log messages can be read.
+	// waitFor(Serial.isConnected, 10000); delay(1000);
+    
+    spiFlash.begin();
+
+	publishQueue
+        .withSpiFlash(&spiFlash, 0, 100 * 4096)
+        .setup();
+
+	Log.info("publishQueue uses %u bytes of RAM", sizeof(publishQueue));
+}
+
+void loop() {
+    publishQueue.loop();
+
+    if (lastPublish == 0 || millis() - lastPublish >= publishPeriod.count()) {
+        lastPublish = millis();
+        publishCounter();
+    }
+
+}
+
+void publishCounter() {
+	Log.info("publishing counter=%d", counter);
+
+	char buf[32];
+	snprintf(buf, sizeof(buf), "%d", counter++);
+
+	publishQueue.publish("testEvent", buf, WITH_ACK);
+}
@@ -0,0 +1,77 @@
+#include "Particle.h"
+
+#include "PublishQueueSpiFlashRK.h"
+
+SYSTEM_THREAD(ENABLED);
+
+SerialLogHandler logHandler(LOG_LEVEL_INFO, { // Logging level for non-application messages
+	{ "app.pubq", LOG_LEVEL_TRACE }
+});
+
+// Pick a chip, port, and CS line
+// SpiFlashISSI spiFlash(SPI, A2);
+// SpiFlashWinbond spiFlash(SPI, A4);
+SpiFlashMacronix spiFlash(SPI, A4);
+// SpiFlashWinbond spiFlash(SPI1, D5);
+
+const std::chrono::milliseconds publishPeriod = 1min;
+const std::chrono::milliseconds statsPeriod = 5min;
+unsigned long lastPublish = 0;
+unsigned long lastStats = 0;
+int counter = 0;
+
+void publishCounter();
+bool logConsumer(const char *eventName, const char *eventData);
+
+
+void setup() {
+	// For testing purposes, wait 10 seconds before continuing to allow serial to connect
+	// before doing PublishQueue setup so the debug log messages can be read.
+	// waitFor(Serial.isConnected, 10000); delay(1000);
+
+    spiFlash.begin();
+
+	// The consumer position is saved in the metadata sectors, which follow the circular buffer.
+	// Up to 20 events not yet handled by the consumer are kept in RAM, including while offline.
+	PublishQueueSpiFlashRK::instance()
+        .withSpiFlash(&spiFlash, 0, 100 * 4096)
+        .withMetadataSector(100 * 4096)
+        .withDrainOrder(PublishQueueSpiFlashRK::DrainOrder::OLDEST_FIRST, 20)
+        .withConsumer("log", logConsumer)
+        .setup();
+
+}
+
+void loop() {
+    PublishQueueSpiFlashRK::instance().loop();
+
+    if (lastPublish == 0 || millis() - lastPublish >= publishPeriod.count()) {
+        lastPublish = millis();
+        publishCounter();
+    }
+
+    if (millis() - lastStats >= statsPeriod.count()) {
+        lastStats = millis();
+
+        PublishQueueSpiFlashRK::ConsumerStats stats;
+        if (PublishQueueSpiFlashRK::instance().getConsumerStats("log", stats)) {
+            Log.info("consumer started=%d sequence=%lu delivered=%lu skipped=%lu lag=%lu",
+                stats.started, stats.sequence, stats.delivered, stats.skipped, stats.lag);
+        }
+    }
+}
+
+void publishCounter() {
+	Log.info("publishing counter=%d", counter);
+
+	char buf[32];
+	snprintf(buf, sizeof(buf), "%d", counter++);
+
+	PublishQueueSpiFlashRK::instance().publish("testEvent", buf, WITH_ACK);
+}
+
+bool logConsumer(const char *eventName, const char *eventData) {
+	// Return false if the event can't be handled now, and it will be delivered again later
+	Log.info("consumer event=%s data=%s", eventName, eventData);
+	return true;
+}
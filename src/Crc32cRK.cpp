@@ -0,0 +1,60 @@
+#include "Crc32cRK.h"
+
+namespace {
+
+struct Crc32cTables {
+    uint32_t table[8][256];
+};
+
+constexpr Crc32cTables makeTables() {
+    Crc32cTables tables = {};
+
+    for(uint32_t ii = 0; ii < 256; ii++) {
+        uint32_t crc = ii;
+        for(int bit = 0; bit < 8; bit++) {
+            crc = (crc & 1) ? ((crc >> 1) ^ Crc32cRK::POLYNOMIAL) : (crc >> 1);
+        }
+        tables.table[0][ii] = crc;
+    }
+
+    // table[n][ii] is the CRC of byte ii followed by n zero bytes
+    for(int slice = 1; slice < 8; slice++) {
+        for(uint32_t ii = 0; ii < 256; ii++) {
+            uint32_t prev = tables.table[slice - 1][ii];
+            tables.table[slice][ii] = (prev >> 8) ^ tables.table[0][prev & 0xff];
+        }
+    }
+    return tables;
+}
+
+constexpr Crc32cTables _tables = makeTables();
+
+}
+
+// [static]
+uint32_t Crc32cRK::calculate(const void *data, size_t len, uint32_t crc) {
+    const uint8_t *p = (const uint8_t *)data;
+    const uint32_t (*t)[256] = _tables.table;
+
+    crc = ~crc;
+
+    // Process 8 bytes at a time. The words are little endian, as on all supported devices.
+    while(len >= 8) {
+        uint32_t one, two;
+        memcpy(&one, p, 4);
+        memcpy(&two, p + 4, 4);
+        one ^= crc;
+
+        crc = t[7][one & 0xff] ^ t[6][(one >> 8) & 0xff] ^ t[5][(one >> 16) & 0xff] ^ t[4][one >> 24] ^
+              t[3][two & 0xff] ^ t[2][(two >> 8) & 0xff] ^ t[1][(two >> 16) & 0xff] ^ t[0][two >> 24];
+
+        p += 8;
+        len -= 8;
+    }
+
+    while(len-- > 0) {
+        crc = t[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+
+    return ~crc;
+}
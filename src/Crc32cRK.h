@@ -0,0 +1,30 @@
+#ifndef __CRC32CRK_H
+#define __CRC32CRK_H
+
+#include "Particle.h"
+
+/**
+ * @brief CRC-32C (Castagnoli) checksum calculation
+ * 
+ * This uses the slice-by-8 algorithm, which processes 8 bytes per iteration using eight 256-entry 
+ * lookup tables. The tables are generated at compile time and stored in flash (8 Kbytes), not RAM.
+ */
+class Crc32cRK {
+public:
+    /**
+     * @brief Calculates the CRC-32C of a buffer
+     * 
+     * @param data Pointer to the data. There are no alignment requirements.
+     * 
+     * @param len Length of the data in bytes
+     * 
+     * @param crc The result of a previous call to continue a calculation across multiple buffers, or 0
+     * 
+     * @return uint32_t The CRC-32C value. "123456789" is 0xe3069283.
+     */
+    static uint32_t calculate(const void *data, size_t len, uint32_t crc = 0);
+
+    static const uint32_t POLYNOMIAL = 0x82f63b78; //!< CRC-32C polynomial, reversed
+};
+
+#endif  /* __CRC32CRK_H */
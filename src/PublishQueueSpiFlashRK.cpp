@@ -1,5 +1,6 @@
 #include "PublishQueueSpiFlashRK.h"
 #include "BackgroundPublishRK.h"
+#include "Crc32cRK.h"
 
 PublishQueueSpiFlashRK *PublishQueueSpiFlashRK::_instance;
 
@@ -26,6 +27,35 @@ PublishQueueSpiFlashRK &PublishQueueSpiFlashRK::withSpiFlash(SpiFlash *spiFlash,
     return *this;
 }
 
+PublishQueueSpiFlashRK &PublishQueueSpiFlashRK::withConsumer(const char *name, ConsumerCallback callback, LagPolicy lagPolicy, size_t maxLagEvents) {
+    if (consumers.size() >= MAX_CONSUMERS) {
+        _log.error("too many consumers, %s not added", name);
+        return *this;
+    }
+
+    Consumer consumer;
+    consumer.name = name;
+    consumer.nameHash = Crc32cRK::calculate(name, strlen(name));
+    consumer.callback = callback;
+    consumer.lagPolicy = lagPolicy;
+    consumer.maxLagEvents = maxLagEvents;
+    if (circBuffer) {
+        // Added after setup(), the metadata has already been loaded
+        if (!hasMetadata) {
+            _log.error("consumers require withMetadataSector(), %s not added", name);
+            return *this;
+        }
+        restoreConsumer(consumer);
+    }
+    consumers.push_back(consumer);
+
+    if (circBuffer && !sequenceValid) {
+        initSequence();
+    }
+
+    return *this;
+}
+
 
 bool PublishQueueSpiFlashRK::setup() {
     if (system_thread_get_state(nullptr) != spark::feature::ENABLED) {
@@ -36,8 +66,18 @@ bool PublishQueueSpiFlashRK::setup() {
         _log.error("spiFlash is not set");
         return false;
     }
+    if (hasMetadata && ((metadataAddr % SECTOR_SIZE) != 0 || (metadataAddr + 2 * SECTOR_SIZE > addrStart && metadataAddr < addrEnd))) {
+        _log.error("metadata sectors must be sector aligned and outside of the circular buffer");
+        return false;
+    }
+    if (!consumers.empty() && !hasMetadata) {
+        // Consumer positions would not survive a reset
+        _log.error("consumers require withMetadataSector()");
+        return false;
+    }
 
     os_mutex_recursive_create(&mutex);
+    os_mutex_recursive_create(&writeMutex);
 
     // Register a system reset handler
     System.on(reset | cloud_status, systemEventHandler);
@@ -48,19 +88,53 @@ bool PublishQueueSpiFlashRK::setup() {
     stateHandler = &PublishQueueSpiFlashRK::stateConnectWait;
 
     circBuffer = new CircularBufferSpiFlashRK(spiFlash, addrStart, addrEnd);
+
+    if (stagingSize) {
+        stagingBuf = new uint8_t[stagingSize];
+    }
+
+    loadMetadata();
+
+    for(auto &consumer : consumers) {
+        restoreConsumer(consumer);
+    }
     
     bool bResult = circBuffer->load();
     if (!bResult) {
-        bResult = circBuffer->format();
+        bResult = formatBuffer();
     }
     if (!bResult) {
         _log.error("circular buffer not initialized");
     }
 
+    if (useSequence()) {
+        // Otherwise this is done by the first getNextSequence(), to avoid a metadata write on every boot
+        initSequence();
+    }
+
     return bResult;
 }
 
 void PublishQueueSpiFlashRK::loop() {
+    if (stagingCount) {
+        flushStaging();
+    }
+
+    if (persistentData.stalePending && !publishInProgress) {
+        reclaimStaleEvents();
+    }
+
+    if (!consumers.empty()) {
+        serviceConsumers();
+    }
+
+    if (useSequence() && !sequenceValid) {
+        // The drain order was changed after setup()
+        initSequence();
+    }
+
+    serviceMetadata();
+
     if (stateHandler) {
         stateHandler(*this);
     }
@@ -68,42 +142,202 @@ void PublishQueueSpiFlashRK::loop() {
 
 
 bool PublishQueueSpiFlashRK::publishCommon(const char *eventName, const char *data, int ttl, PublishFlags flags1, PublishFlags flags2) {
+    unsigned long startUs = micros();
     PublishFlags flags = flags1 | flags2;
 
     if (!data) { 
         data = "";
     }
 
+    bool blocked;
+    WITH_LOCK(*this) {
+        blocked = isConsumerBlocking();
+    }
+    if (blocked) {
+        _log.error("event %s not queued, consumer is maxLagEvents behind", eventName);
+        addEnqueueLatency(micros() - startUs);
+        return false;
+    }
+
+    if (useSequence() && !sequenceValid) {
+        // Not under the lock, as this can erase a metadata sector
+        initSequence();
+    }
+
     CircularBufferSpiFlashRK::DataBuffer dataBuffer;
 
-    size_t size = strlen(eventName) + strlen(data) + 64;
+    size_t size = strlen(eventName) + strlen(data) + 128;
     char *buf = (char *)dataBuffer.allocate(size);
 
+    // The sequence number is assigned in the same locked section that stages the event or, for a
+    // direct write, while holding writeMutex until it's written. Events are then in sequence order
+    // in flash and in liveEvents even when several threads publish at once. Staged events don't wait
+    // for writeMutex, so publish() doesn't wait for a write in flushStaging().
+    bool writeLocked = false;
+    bool staged = false;
+    bool stagingFull = false;
+    bool direct = false;
+    uint32_t sequence = 0;
+    size_t recordSize = 0;
+    while(!staged && !stagingFull && !direct) {
+        WITH_LOCK(*this) {
+            if (useSequence()) {
+                sequence = getNextSequence();
+            }
+            recordSize = formatRecord(buf, size, eventName, data, flags, sequence);
+
+            // The write position isn't known, so any write could erase a sector. All events are staged.
+            if (stagingBuf && stagingUsed + 2 + recordSize <= stagingSize) {
+                stagingBuf[stagingUsed++] = (uint8_t)recordSize;
+                stagingBuf[stagingUsed++] = (uint8_t)(recordSize >> 8);
+                memcpy(&stagingBuf[stagingUsed], buf, recordSize);
+                stagingUsed += recordSize;
+                stagingCount++;
+                enqueueStagedCount++;
+                staged = true;
+            }
+            else
+            if (stagingBuf && stagingCount) {
+                // Writing it now would put it ahead of the staged events, and flushing here would 
+                // do the erase in publish()
+                stagingFull = true;
+            }
+            else
+            if (writeLocked) {
+                // No staging buffer, or it's larger than the staging buffer and none are staged
+                direct = true;
+            }
+
+            if (staged || direct) {
+                addLiveEvent(sequence, buf);
+            }
+            else
+            if (useSequence()) {
+                // Not queued, or writeMutex has to be locked first, so the number is used again
+                nextSequence--;
+            }
+        }
+
+        if (!staged && !stagingFull && !direct) {
+            // writeMutex is always locked before the queue lock
+            os_mutex_recursive_lock(writeMutex);
+            writeLocked = true;
+        }
+    }
+
+    bool bResult = staged;
+    if (direct) {
+        dataBuffer.truncate(recordSize);
+        bResult = circBuffer->writeData(dataBuffer);
+
+        WITH_LOCK(*this) {
+            if (bResult) {
+                addQueuedRecord(recordSize);
+            }
+            else {
+                removeLiveEvent(sequence);
+            }
+        }
+    }
+    if (writeLocked) {
+        os_mutex_recursive_unlock(writeMutex);
+    }
+
+    if (bResult) {
+        _log.trace("event %s %s", eventName, staged ? "staged" : "queued");
+
+        if (updateWearStats(strlen(eventName) + strlen(data), recordSize)) {
+            // Saved from loop(), not here, so publish() doesn't write the metadata sector
+            WITH_LOCK(*this) {
+                metadataSaveRequested = true;
+            }
+        }
+    }
+    else {
+        _log.error("event %s not queued%s", eventName, stagingFull ? ", staging buffer full" : "");
+    }
+
+    // _log.print(buf); _log.print("\n");
+
+    addEnqueueLatency(micros() - startUs);
+
+    return bResult;
+}
+
+
+size_t PublishQueueSpiFlashRK::formatRecord(char *buf, size_t size, const char *eventName, const char *data, PublishFlags flags, uint32_t sequence) {
     memset(buf, 0, size);
-    JSONBufferWriter writer(buf, size);
+    JSONBufferWriter writer(buf, size - sizeof(uint32_t));
 
     writer.beginObject();
     writer.name("n").value(eventName);
     writer.name("d").value(data);
     writer.name("NO_ACK").value((flags.value() & NO_ACK.value()) != 0);
     writer.name("WITH_ACK").value((flags.value() & WITH_ACK.value()) != 0);
+    if (persistentData.generation) {
+        writer.name("g").value((int)persistentData.generation);
+    }
+    if (useSequence()) {
+        writer.name("s").value((int)sequence);
+    }
     writer.endObject();
 
-    dataBuffer.truncate(strlen(buf) + 1);
+    // The CRC-32C of the JSON and its null terminator follows the null terminator
+    size_t recordSize = strlen(buf) + 1;
+    uint32_t crc = Crc32cRK::calculate(buf, recordSize);
+    memcpy(&buf[recordSize], &crc, sizeof(uint32_t));
+    recordSize += sizeof(uint32_t);
 
-    bool bResult = circBuffer->writeData(dataBuffer);
-    if (bResult) {
-        _log.trace("event %s queued", eventName);
+    return recordSize;
+}
+
+void PublishQueueSpiFlashRK::addLiveEvent(uint32_t sequence, const char *json) {
+    if (!useSequence()) {
+        return;
+    }
+    if (isSequenceBefore(lastQueuedSequence, sequence)) {
+        lastQueuedSequence = sequence;
+    }
+    if (liveEventsMax) {
+        if (liveEvents.size() >= liveEventsMax) {
+            // The oldest live event is still in the circular buffer, or staged
+            if (isSequenceBefore(liveEventsFloor, liveEvents.front().sequence)) {
+                liveEventsFloor = liveEvents.front().sequence;
+            }
+            liveEvents.pop_front();
+        }
+        LiveEvent liveEvent;
+        liveEvent.sequence = sequence;
+        liveEvent.json = json;
+        liveEvents.push_back(liveEvent);
     }
     else {
-        _log.error("event %s not queued", eventName);
+        // Consumers read it from flash
+        liveEventsFloor = sequence;
     }
-
-    // _log.print(buf); _log.print("\n");
-
-    return bResult;
 }
 
+void PublishQueueSpiFlashRK::removeLiveEvent(uint32_t sequence) {
+    if (!useSequence()) {
+        return;
+    }
+    for(auto it = liveEvents.begin(); it != liveEvents.end(); ++it) {
+        if (it->sequence == sequence) {
+            liveEvents.erase(it);
+            break;
+        }
+    }
+    // If it was already published from liveEvents, it won't be read from flash
+    for(auto it = skipSequences.begin(); it != skipSequences.end(); ++it) {
+        if (*it == sequence) {
+            skipSequences.erase(it);
+            break;
+        }
+    }
+    if (lastQueuedSequence == sequence) {
+        lastQueuedSequence = sequence - 1;
+    }
+}
 
 void PublishQueueSpiFlashRK::publishCompleteCallback(bool succeeded, const char *eventName, const char *eventData) {
     publishComplete = true;
@@ -116,22 +350,167 @@ void PublishQueueSpiFlashRK::publishCompleteCallback(bool succeeded, const char
 
 
 size_t PublishQueueSpiFlashRK::getNumEvents() {
-    size_t numEvents = 0;
+    size_t result = 0;
+
+    WITH_LOCK(*this) {
+        if (!numEventsValid) {
+            numEvents = 0;
+
+            CircularBufferSpiFlashRK::UsageStats stats;
+            if (circBuffer->getUsageStats(stats)) {
+                // Events discarded by clearQueues() and not reclaimed yet can't be told apart without
+                // reading them, so they're counted until reclaimStaleEvents() finishes and this is recounted
+                numEvents = stats.recordCount;
+                numEventsIncludesStale = (persistentData.stalePending != 0);
+                queuedBytes = stats.dataSize;
+                numEventsValid = true;
+            }
+        }
+        // Events already published from liveEvents are still in the circular buffer
+        result = numEvents + stagingCount;
+        result -= (skipSequences.size() < result) ? skipSequences.size() : result;
+    }
+    return result;
+}
+
+void PublishQueueSpiFlashRK::markEventRead() {
+    circBuffer->markAsRead(curEvent);
+
+    WITH_LOCK(*this) {
+        curEventValid = false;
+        queuedBytes -= (curEvent.size() < queuedBytes) ? curEvent.size() : queuedBytes;
+        if ((numEventsIncludesStale || !isStaleGeneration(curEventGeneration)) && numEvents > 0) {
+            numEvents--;
+        }
+    }
+}
+
+void PublishQueueSpiFlashRK::reclaimStaleEvents() {
+    unsigned long startMs = millis();
+    bool done = false;
+
+    while(!done && millis() - startMs < reclaimBudgetMs) {
+        WITH_LOCK(*this) {
+            // Events are in order, so the first event from the current generation means there are no more stale events
+            if (!readHead() || !isStaleGeneration(curEventGeneration)) {
+                persistentData.stalePending = 0;
+                numEventsValid = false;
+                done = true;
+            }
+            else {
+                markEventRead();
+            }
+        }
+    }
+
+    if (done) {
+        _log.trace("reclaimStaleEvents complete");
+        saveMetadata();
+    }
+}
+
+void PublishQueueSpiFlashRK::addQueuedRecord(size_t recordSize) {
+    WITH_LOCK(*this) {
+        numEvents++;
+        queuedBytes += recordSize;
+
+        // Records and their overhead can't take more than twice their size in flash, so until the
+        // record data reaches half of the buffer, a write can't fill it and discard the oldest sector.
+        if (queuedBytes * 2 >= (getNumSectors() - 1) * SECTOR_SIZE) {
+            invalidateCache();
+        }
+    }
+}
 
-    CircularBufferSpiFlashRK::UsageStats stats;
-    if (circBuffer->getUsageStats(stats)) {
-        numEvents = stats.recordCount;
+void PublishQueueSpiFlashRK::invalidateCache() {
+    WITH_LOCK(*this) {
+        curEventValid = false;
+        numEventsValid = false;
     }
-    return numEvents;
+}
+
+
+bool PublishQueueSpiFlashRK::getWearStats(WearStats &stats) {
+    if (!circBuffer) {
+        return false;
+    }
+
+    WITH_LOCK(*this) {
+        stats.numSectors = getNumSectors();
+        stats.sectorErases = persistentData.sectorErases;
+        stats.eraseCount = persistentData.sectorErases / stats.numSectors;
+        stats.metadataEraseCount = (persistentData.metadataErases + 1) / 2;
+        stats.userBytes = persistentData.userBytes;
+        stats.flashBytes = persistentData.flashBytes;
+        stats.observedSecs = bootObservedSecs + (uint32_t)(System.millis() / 1000);
+    }
+
+    stats.writeAmplification = 0.0;
+    if (stats.userBytes) {
+        stats.writeAmplification = (float)((double)stats.flashBytes / (double)stats.userBytes);
+    }
+
+    // Each circular buffer sector is erased once per pass through the buffer, so its erase rate is
+    // the flash bytes rate divided by the size of the buffer. The metadata sectors are erased in turn.
+    stats.projectedLifetimeDays = 0.0;
+    if (stats.observedSecs) {
+        double days = 0.0;
+        if (stats.flashBytes) {
+            double erasesPerSec = (double)stats.flashBytes / (double)(stats.numSectors * SECTOR_SIZE) / (double)stats.observedSecs;
+            double remaining = (stats.eraseCount < flashEndurance) ? (double)(flashEndurance - stats.eraseCount) : 0.0;
+            days = remaining / erasesPerSec / 86400.0;
+        }
+        if (stats.metadataEraseCount) {
+            double erasesPerSec = (double)stats.metadataEraseCount / (double)stats.observedSecs;
+            double remaining = (stats.metadataEraseCount < flashEndurance) ? (double)(flashEndurance - stats.metadataEraseCount) : 0.0;
+            double metadataDays = remaining / erasesPerSec / 86400.0;
+            if (days == 0.0 || metadataDays < days) {
+                days = metadataDays;
+            }
+        }
+        stats.projectedLifetimeDays = (float)days;
+    }
+
+    return true;
 }
 
 
 void PublishQueueSpiFlashRK::clearQueues() {
     WITH_LOCK(*this) {
-        circBuffer->format();
+        stagingUsed = 0;
+        stagingCount = 0;
+        stagingClears++;
+        liveEvents.clear();
+        skipSequences.clear();
+
+        if (sequenceValid) {
+            // Consumers don't get the discarded events either
+            liveEventsFloor = nextSequence - 1;
+            lastQueuedSequence = nextSequence - 1;
+            for(auto &consumer : consumers) {
+                if (consumer.started && isSequenceBefore(consumer.sequence, lastQueuedSequence)) {
+                    consumer.sequence = lastQueuedSequence;
+                }
+            }
+        }
+
+        if (hasMetadata) {
+            // Existing events become stale and are marked as read later from loop(), without counting them here
+            persistentData.stalePending = 1;
+            persistentData.generation++;
+            numEvents = 0;
+            numEventsValid = true;
+            numEventsIncludesStale = false;
+            curEventValid = false;
+            saveMetadata();
+        }
+        else {
+            // The generation would not survive a reset, so erase everything now
+            formatBuffer();
+        }
     }
 
-    _log.trace("clearQueues");
+    _log.trace("clearQueues generation=%lu", persistentData.generation);
 }
 
 void PublishQueueSpiFlashRK::setPausePublishing(bool value) { 
@@ -152,6 +531,7 @@ void PublishQueueSpiFlashRK::stateConnectWait() {
     if (Particle.connected()) {
         stateTime = millis();
         durationMs = waitAfterConnect;
+        liveDurationMs = waitAfterConnect;
         stateHandler = &PublishQueueSpiFlashRK::stateWait;
     }
 }
@@ -168,99 +548,816 @@ void PublishQueueSpiFlashRK::stateWait() {
         return;
     }
 
+    if (drainOrder == DrainOrder::NEWEST_FIRST && millis() - stateTime >= liveDurationMs) {
+        // The newest event is published first, before older events in the circular buffer
+        String json;
+        WITH_LOCK(*this) {
+            // Each event published from RAM is remembered until its copy in flash is skipped. While 
+            // skipSequences is full, events are published in order from flash instead.
+            for(auto it = liveEvents.rbegin(); it != liveEvents.rend() && skipSequences.size() < SKIP_SEQUENCES_MAX; ++it) {
+                // Events kept for consumers may already have been published
+                if (!it->published) {
+                    json = it->json;
+                    curLiveSequence = it->sequence;
+                    break;
+                }
+            }
+        }
+        if (json.length()) {
+            _log.trace("got live event %s", json.c_str());
+
+            EventInfo eventInfo;
+            parseEvent(json.c_str(), eventInfo);
+
+            publishSource = PublishSource::LIVE;
+            startPublish(eventInfo);
+            return;
+        }
+    }
+
     if (millis() - stateTime < durationMs) {
         canSleep = (getNumEvents() == 0);
         return;
     }
     
-    if (circBuffer->readData(curEvent)) {
-        _log.trace("got event from queue %s", curEvent.c_str());
-
-        stateTime = millis();
-        stateHandler = &PublishQueueSpiFlashRK::statePublishWait;
-        publishComplete = false;
-        publishSuccess = false;
-        canSleep = false;
-
-        String eventName;
-        String eventData;
-        PublishFlags eventFlags;
-
-        JSONValue outerObj = JSONValue::parseCopy(curEvent.c_str());
-
-        JSONObjectIterator iter(outerObj);
-        while(iter.next()) {
-            if (iter.name() == "n") {
-                eventName = iter.value().toString().data();
-            }
-            else
-            if (iter.name() == "d") {
-                eventData = iter.value().toString().data();
-            }
-            else
-            if (iter.name() == "NO_ACK" && iter.value().toBool()) {
-                eventFlags |= NO_ACK;
-            }
-            else
-            if (iter.name() == "WITH_ACK" && iter.value().toBool()) {
-                eventFlags |= WITH_ACK;
-            }
-        }
-        if (eventName.length()) {
-            // This message is monitored by the automated test tool. If you edit this, change that too.
-            _log.trace("publishing event=%s data=%s", eventName.c_str(), eventData.c_str());
+    // The event is kept after a failed publish, so a retry does not read it again
+    if (!readHead()) {
+        // No events, can sleep
+        canSleep = true;
+        return;
+    }
 
-            if (BackgroundPublishRK::instance().publish(eventName, eventData, eventFlags, 
-                [this](bool succeeded, const char *eventName, const char *eventData, const void *context) {
-                    publishCompleteCallback(succeeded, eventName, eventData);
-                })) {
-                // Successfully started publish
-            }
-        }
-        else {
-            // Invalid event
-            _log.error("invalid event, no event name, discarding");
-            circBuffer->markAsRead(curEvent);
+    if (isStaleGeneration(curEventGeneration)) {
+        // Discarded by clearQueues() but not reclaimed yet, skip without waiting
+        _log.trace("discarding event from earlier generation");
+        markEventRead();
 
-            durationMs = waitAfterFailure;
-            stateHandler = &PublishQueueSpiFlashRK::stateWait;
-            stateTime = millis();
+        durationMs = 0;
+        stateTime = millis();
+    }
+    else
+    if (curEventInfo.hasSequence && removeSkipSequence(curEventInfo.sequence)) {
+        // Already published from liveEvents
+        _log.trace("skipping event already published sequence=%lu", curEventInfo.sequence);
+        markEventRead();
 
-            canSleep = true;
+        durationMs = 0;
+        stateTime = millis();
+    }
+    else
+    if (curEventInfo.name.length()) {
+        if (curEventInfo.hasSequence) {
+            setLivePublished(curEventInfo.sequence, true);
         }
+        publishSource = PublishSource::QUEUE;
+        startPublish(curEventInfo);
     }
     else {
-        // No events, can sleep
+        // Invalid event
+        _log.error("invalid event, no event name, discarding");
+        markEventRead();
+
+        durationMs = waitAfterFailure;
+        liveDurationMs = waitAfterFailure;
+        stateTime = millis();
+
         canSleep = true;
     }
 }
+
 void PublishQueueSpiFlashRK::statePublishWait() {
     if (!publishComplete) {
         return;
     }
+    publishInProgress = false;
 
     if (publishSuccess) {
         // Remove from the queue
         _log.trace("publish success");
 
-        circBuffer->markAsRead(curEvent);
-        durationMs = waitBetweenPublish;
+        if (publishSource == PublishSource::LIVE) {
+            // The copy in the circular buffer is skipped when it's reached
+            setLivePublished(curLiveSequence, false);
+            WITH_LOCK(*this) {
+                skipSequences.push_back(curLiveSequence);
+            }
+        }
+        else {
+            markEventRead();
+        }
+        durationMs = (drainOrder == DrainOrder::NEWEST_FIRST) ? waitBetweenHistoryPublish : waitBetweenPublish;
+        liveDurationMs = waitBetweenPublish;
     }
     else {
         // Wait and retry
         // This message is monitored by the automated test tool. If you edit this, change that too.
         _log.trace("publish failed");
         durationMs = waitAfterFailure;
+        liveDurationMs = waitAfterFailure;
     }
 
     stateHandler = &PublishQueueSpiFlashRK::stateWait;
     stateTime = millis();
 }
 
+void PublishQueueSpiFlashRK::startPublish(const EventInfo &eventInfo) {
+    stateTime = millis();
+    stateHandler = &PublishQueueSpiFlashRK::statePublishWait;
+    publishComplete = false;
+    publishSuccess = false;
+    publishInProgress = true;
+    canSleep = false;
+
+    // This message is monitored by the automated test tool. If you edit this, change that too.
+    _log.trace("publishing event=%s data=%s", eventInfo.name.c_str(), eventInfo.data.c_str());
+
+    if (BackgroundPublishRK::instance().publish(eventInfo.name, eventInfo.data, eventInfo.flags, 
+        [this](bool succeeded, const char *eventName, const char *eventData, const void *context) {
+            publishCompleteCallback(succeeded, eventName, eventData);
+        })) {
+        // Successfully started publish
+    }
+}
+
+// [static]
+bool PublishQueueSpiFlashRK::verifyEvent(const CircularBufferSpiFlashRK::ReadInfo &readInfo) {
+    const char *json = readInfo.c_str();
+    size_t jsonSize = strnlen(json, readInfo.size()) + 1;
+
+    if (jsonSize == readInfo.size()) {
+        // Written by an earlier version, without a CRC
+        return true;
+    }
+    if (jsonSize + sizeof(uint32_t) != readInfo.size()) {
+        return false;
+    }
+
+    uint32_t crc;
+    memcpy(&crc, &json[jsonSize], sizeof(uint32_t));
+    return crc == Crc32cRK::calculate(json, jsonSize);
+}
+
+// [static]
+void PublishQueueSpiFlashRK::parseEvent(const char *json, EventInfo &eventInfo) {
+    JSONValue outerObj = JSONValue::parseCopy(json);
+
+    JSONObjectIterator iter(outerObj);
+    while(iter.next()) {
+        if (iter.name() == "n") {
+            eventInfo.name = iter.value().toString().data();
+        }
+        else
+        if (iter.name() == "d") {
+            eventInfo.data = iter.value().toString().data();
+        }
+        else
+        if (iter.name() == "NO_ACK" && iter.value().toBool()) {
+            eventInfo.flags |= NO_ACK;
+        }
+        else
+        if (iter.name() == "WITH_ACK" && iter.value().toBool()) {
+            eventInfo.flags |= WITH_ACK;
+        }
+        else
+        if (iter.name() == "g") {
+            eventInfo.generation = (uint32_t)iter.value().toInt();
+        }
+        else
+        if (iter.name() == "s") {
+            eventInfo.sequence = (uint32_t)iter.value().toInt();
+            eventInfo.hasSequence = true;
+        }
+    }
+}
+
+void PublishQueueSpiFlashRK::setLivePublished(uint32_t sequence, bool andEarlier) {
+    WITH_LOCK(*this) {
+        for(auto &liveEvent : liveEvents) {
+            if (liveEvent.sequence == sequence || (andEarlier && isSequenceBefore(liveEvent.sequence, sequence))) {
+                liveEvent.published = true;
+            }
+        }
+        pruneLiveEvents();
+    }
+}
+
+void PublishQueueSpiFlashRK::pruneLiveEvents() {
+    WITH_LOCK(*this) {
+        for(auto it = liveEvents.begin(); it != liveEvents.end(); ) {
+            // In oldest first order, live events are only kept for consumers
+            bool needed = (drainOrder == DrainOrder::NEWEST_FIRST && !it->published);
+            for(const auto &consumer : consumers) {
+                if (!consumer.started || isSequenceBefore(consumer.sequence, it->sequence)) {
+                    needed = true;
+                }
+            }
+            if (needed) {
+                ++it;
+            }
+            else {
+                it = liveEvents.erase(it);
+            }
+        }
+    }
+}
+
+bool PublishQueueSpiFlashRK::readHead() {
+    WITH_LOCK(*this) {
+        while(!curEventValid) {
+            if (!circBuffer->readData(curEvent)) {
+                // The circular buffer is empty, so the cached count can't be more than 0
+                numEvents = 0;
+                numEventsValid = true;
+                queuedBytes = 0;
+                persistentData.stalePending = 0;
+                break;
+            }
+            curEventValid = true;
+            curEventInfo = EventInfo();
+
+            if (!verifyEvent(curEvent)) {
+                // Skip without publishing or waiting
+                _log.error("event failed CRC check, discarding");
+                corruptEvents++;
+
+                // Its generation can't be known, so instead of updating numEvents, count the events again
+                circBuffer->markAsRead(curEvent);
+                curEventValid = false;
+                numEventsValid = false;
+                continue;
+            }
+
+            _log.trace("got event from queue %s", curEvent.c_str());
+            parseEvent(curEvent.c_str(), curEventInfo);
+            curEventGeneration = curEventInfo.generation;
+
+            if (isSequenceBefore(persistentData.generation, curEventGeneration)) {
+                // The metadata with the latest generation was lost. Never go back to an earlier
+                // generation, or events queued after the last clearQueues() would be discarded.
+                _log.error("event generation %lu is after %lu, updating", curEventGeneration, persistentData.generation);
+                persistentData.generation = curEventGeneration;
+                saveMetadata();
+            }
+        }
+    }
+    return curEventValid;
+}
+
+void PublishQueueSpiFlashRK::serviceConsumers() {
+    for(auto &consumer : consumers) {
+        EventInfo eventInfo;
+        bool found;
+
+        WITH_LOCK(*this) {
+            if (!consumer.started) {
+                startConsumer(consumer);
+            }
+            if (consumer.lagPolicy == LagPolicy::SKIP && consumer.maxLagEvents && getConsumerLag(consumer) > consumer.maxLagEvents) {
+                skipConsumer(consumer, lastQueuedSequence - (uint32_t)consumer.maxLagEvents);
+            }
+            found = getConsumerEvent(consumer, eventInfo);
+        }
+
+        // The callback is called without holding the lock so it can publish events
+        if (found && consumer.callback(eventInfo.name.c_str(), eventInfo.data.c_str())) {
+            WITH_LOCK(*this) {
+                // clearQueues() may have moved the consumer past it during the callback
+                if (isSequenceBefore(consumer.sequence, eventInfo.sequence)) {
+                    if (isSequenceBefore(consumer.sequence + 1, eventInfo.sequence)) {
+                        // The events in between were discarded before the consumer got to them, or failed to write
+                        consumer.skipped += eventInfo.sequence - consumer.sequence - 1;
+                    }
+                    consumer.sequence = eventInfo.sequence;
+                    consumer.delivered++;
+                    cursorChanges++;
+                }
+            }
+        }
+    }
+
+    pruneLiveEvents();
+
+    if (cursorChanges >= CURSOR_SAVE_INTERVAL) {
+        cursorChanges = 0;
+        saveMetadata();
+    }
+}
+
+void PublishQueueSpiFlashRK::startConsumer(Consumer &consumer) {
+    WITH_LOCK(*this) {
+        // If nothing is waiting to be published, start with the next event
+        consumer.sequence = lastQueuedSequence;
+        if (readHead() && curEventInfo.hasSequence && !isStaleGeneration(curEventGeneration)) {
+            consumer.sequence = curEventInfo.sequence - 1;
+        }
+        else
+        if (!liveEvents.empty()) {
+            consumer.sequence = liveEvents.front().sequence - 1;
+        }
+        consumer.started = true;
+        cursorChanges++;
+        _log.trace("consumer %s started sequence=%lu", consumer.name.c_str(), consumer.sequence);
+    }
+}
+
+bool PublishQueueSpiFlashRK::getConsumerEvent(Consumer &consumer, EventInfo &eventInfo) {
+    if (isSequenceBefore(consumer.sequence, liveEventsFloor)) {
+        // Queued before startup, or no longer in liveEvents. Only the oldest event in flash can be read.
+        if (readHead()) {
+            if (!curEventInfo.hasSequence || isStaleGeneration(curEventGeneration)) {
+                // Published or reclaimed from loop() before the events the consumer needs
+                return false;
+            }
+            if (isSequenceBefore(consumer.sequence, curEventInfo.sequence)) {
+                // Events before the oldest one are no longer in flash, but may be in liveEvents
+                uint32_t sequence = curEventInfo.sequence - 1;
+                skipConsumer(consumer, isSequenceBefore(sequence, liveEventsFloor) ? sequence : liveEventsFloor);
+                if (consumer.sequence == sequence) {
+                    eventInfo = curEventInfo;
+                    return true;
+                }
+            }
+            else {
+                // The next one is in flash after the oldest event, so wait for the cloud to publish up to it
+                return false;
+            }
+        }
+        else {
+            if (stagingCount) {
+                // Events removed from liveEvents may not have been written to flash yet
+                return false;
+            }
+            // Not in flash, staged, or in liveEvents, so they can't be delivered
+            skipConsumer(consumer, liveEventsFloor);
+        }
+    }
+
+    // Sequence numbers are not necessarily consecutive, a failed write uses one
+    for(const auto &liveEvent : liveEvents) {
+        if (isSequenceBefore(consumer.sequence, liveEvent.sequence)) {
+            eventInfo = EventInfo();
+            parseEvent(liveEvent.json.c_str(), eventInfo);
+            return true;
+        }
+    }
+    return false;
+}
+
+void PublishQueueSpiFlashRK::skipConsumer(Consumer &consumer, uint32_t sequence) {
+    if (isSequenceBefore(consumer.sequence, sequence)) {
+        _log.trace("consumer %s skipping from sequence=%lu to %lu", consumer.name.c_str(), consumer.sequence, sequence);
+        consumer.skipped += sequence - consumer.sequence;
+        consumer.sequence = sequence;
+        cursorChanges++;
+    }
+}
+
+uint32_t PublishQueueSpiFlashRK::getConsumerLag(const Consumer &consumer) const {
+    if (!consumer.started || !isSequenceBefore(consumer.sequence, lastQueuedSequence)) {
+        return 0;
+    }
+    uint32_t lag = lastQueuedSequence - consumer.sequence;
+
+    // Events in liveEvents may already be published and no longer in flash
+    uint32_t queued = numEvents + stagingCount + liveEvents.size();
+    return (lag < queued) ? lag : queued;
+}
+
+bool PublishQueueSpiFlashRK::isConsumerBlocking() const {
+    for(const auto &consumer : consumers) {
+        if (consumer.lagPolicy == LagPolicy::BLOCK && consumer.maxLagEvents && getConsumerLag(consumer) >= consumer.maxLagEvents) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void PublishQueueSpiFlashRK::restoreConsumer(Consumer &consumer) {
+    for(size_t ii = 0; ii < MAX_CONSUMERS; ii++) {
+        if (persistentData.cursors[ii].nameHash != 0 && persistentData.cursors[ii].nameHash == consumer.nameHash) {
+            consumer.sequence = persistentData.cursors[ii].sequence;
+            consumer.started = true;
+            _log.trace("consumer %s restored sequence=%lu", consumer.name.c_str(), consumer.sequence);
+            break;
+        }
+    }
+}
+
+bool PublishQueueSpiFlashRK::getConsumerStats(const char *name, ConsumerStats &stats) {
+    bool found = false;
+
+    WITH_LOCK(*this) {
+        for(const auto &consumer : consumers) {
+            if (consumer.name == name) {
+                stats.started = consumer.started;
+                stats.sequence = consumer.sequence;
+                stats.delivered = consumer.delivered;
+                stats.skipped = consumer.skipped;
+                stats.lag = getConsumerLag(consumer);
+                found = true;
+                break;
+            }
+        }
+    }
+    return found;
+}
+
+bool PublishQueueSpiFlashRK::removeSkipSequence(uint32_t sequence) {
+    bool found = false;
+
+    WITH_LOCK(*this) {
+        // Sequence numbers before this one will never be read, because the circular buffer is in order
+        for(auto it = skipSequences.begin(); it != skipSequences.end(); ) {
+            if ((int32_t)(*it - sequence) <= 0) {
+                found = found || (*it == sequence);
+                it = skipSequences.erase(it);
+            }
+            else {
+                ++it;
+            }
+        }
+    }
+    return found;
+}
+
+
+void PublishQueueSpiFlashRK::initSequence() {
+    WITH_LOCK(*this) {
+        if (hasMetadata) {
+            // Skip any sequence numbers that may have been used before a reset
+            nextSequence = persistentData.sequence;
+            for(const auto &consumer : consumers) {
+                if (consumer.started && !isSequenceBefore(consumer.sequence, nextSequence)) {
+                    // It handled events that were not in the saved metadata before the reset
+                    nextSequence = consumer.sequence + 1;
+                }
+            }
+            persistentData.sequence = nextSequence + SEQUENCE_RESERVE;
+            metadataSaveRequested = true;
+        }
+        else {
+            nextSequence = HAL_RNG_GetRandomNumber();
+        }
+        lastQueuedSequence = nextSequence - 1;
+        liveEventsFloor = nextSequence - 1;
+        sequenceValid = true;
+    }
+
+    // The reserved block must be saved before its numbers are used, even if the other sector has 
+    // to be erased first
+    serviceMetadata();
+}
+
+uint32_t PublishQueueSpiFlashRK::getNextSequence() {
+    uint32_t sequence;
+
+    WITH_LOCK(*this) {
+        if (!sequenceValid) {
+            initSequence();
+        }
+        sequence = nextSequence++;
+        if (hasMetadata && (int32_t)(persistentData.sequence - nextSequence) < (int32_t)(SEQUENCE_RESERVE / 2)) {
+            // The next block is reserved while half of this one is left, so it's saved from loop() 
+            // before the saved limit is reached
+            persistentData.sequence = nextSequence + SEQUENCE_RESERVE;
+            metadataSaveRequested = true;
+        }
+    }
+    return sequence;
+}
+
+bool PublishQueueSpiFlashRK::getEnqueueStats(EnqueueStats &stats) {
+    WITH_LOCK(*this) {
+        stats.count = enqueueCount;
+        stats.stagedCount = enqueueStagedCount;
+        stats.p50Micros = getEnqueueLatencyPercentile(50);
+        stats.p99Micros = getEnqueueLatencyPercentile(99);
+        stats.maxMicros = enqueueMaxMicros;
+    }
+    return true;
+}
+
+void PublishQueueSpiFlashRK::flushStaging() {
+    WITH_LOCK(*this) {
+        if (flushInProgress) {
+            return;
+        }
+        flushInProgress = true;
+    }
+
+    // The lock is only held to copy each event out of the staging buffer, not during the write 
+    // and sector erase, so publish() from another thread can still stage events behind these ones
+    while(true) {
+        CircularBufferSpiFlashRK::DataBuffer dataBuffer;
+        size_t recordSize = 0;
+        uint32_t clears;
+
+        // Held until the event is removed from the staging buffer, so a direct write in publishCommon()
+        // can't get ahead of it
+        os_mutex_recursive_lock(writeMutex);
+
+        WITH_LOCK(*this) {
+            if (stagingCount) {
+                recordSize = stagingBuf[0] | (stagingBuf[1] << 8);
+                memcpy(dataBuffer.allocate(recordSize), &stagingBuf[2], recordSize);
+            }
+            clears = stagingClears;
+        }
+        if (!recordSize) {
+            os_mutex_recursive_unlock(writeMutex);
+            break;
+        }
+
+        bool written = circBuffer->writeData(dataBuffer);
+        if (!written) {
+            _log.error("staged event not queued");
+        }
+
+        WITH_LOCK(*this) {
+            if (clears != stagingClears) {
+                // clearQueues() was called during the write and emptied the staging buffer. The event
+                // has the previous generation, so it's stale and loop() has to reclaim it.
+                if (written) {
+                    queuedBytes += recordSize;
+                    if (hasMetadata) {
+                        persistentData.stalePending = 1;
+                        metadataSaveRequested = true;
+                    }
+                    else {
+                        // There's no generation to discard it by, so it's queued after the format
+                        invalidateCache();
+                    }
+                }
+            }
+            else {
+                if (written) {
+                    addQueuedRecord(recordSize);
+                }
+                size_t used = 2 + recordSize;
+                memmove(stagingBuf, &stagingBuf[used], stagingUsed - used);
+                stagingUsed -= used;
+                stagingCount--;
+            }
+        }
+
+        os_mutex_recursive_unlock(writeMutex);
+    }
+
+    WITH_LOCK(*this) {
+        flushInProgress = false;
+    }
+}
+
+void PublishQueueSpiFlashRK::addEnqueueLatency(uint32_t micros) {
+    size_t bucket = 0;
+    while(bucket < LATENCY_BUCKETS - 1 && (micros >> bucket) != 0) {
+        bucket++;
+    }
+
+    WITH_LOCK(*this) {
+        enqueueLatency[bucket]++;
+        enqueueCount++;
+        if (micros > enqueueMaxMicros) {
+            enqueueMaxMicros = micros;
+        }
+    }
+}
+
+uint32_t PublishQueueSpiFlashRK::getEnqueueLatencyPercentile(uint32_t percent) const {
+    uint64_t target = ((uint64_t)enqueueCount * percent + 99) / 100;
+    uint64_t sum = 0;
+
+    for(size_t bucket = 0; bucket < LATENCY_BUCKETS; bucket++) {
+        sum += enqueueLatency[bucket];
+        if (sum >= target && sum > 0) {
+            return (bucket < LATENCY_BUCKETS - 1) ? ((1UL << bucket) - 1) : enqueueMaxMicros;
+        }
+    }
+    return 0;
+}
+
+void PublishQueueSpiFlashRK::loadMetadata() {
+    memset(&persistentData, 0, sizeof(persistentData));
+    persistentData.writeOffset = SECTOR_HEADER_SIZE;
+    metadataSector = 0;
+    metadataOffset = 0;
+
+    if (!hasMetadata) {
+        return;
+    }
+
+    // The sectors are written alternately, so the newest record can be in either one
+    bool found = false;
+    size_t offsets[2];
+    for(size_t sectorIndex = 0; sectorIndex < 2; sectorIndex++) {
+        PersistentData sectorData;
+        if (loadMetadataSector(sectorIndex, sectorData, offsets[sectorIndex]) && 
+            (!found || isSequenceBefore(persistentData.saveCount, sectorData.saveCount))) {
+            persistentData = sectorData;
+            metadataSector = sectorIndex;
+            found = true;
+        }
+    }
+    metadataOffset = offsets[metadataSector];
+    bootObservedSecs = persistentData.observedSecs;
+
+    // saveMetadata() can switch to the other sector without waiting for loop() to erase it
+    metadataSpareErased = isMetadataSectorErased(1 - metadataSector);
+
+    _log.trace("loadMetadata sector=%u offset=%u saveCount=%lu generation=%lu", metadataSector, metadataOffset, 
+        persistentData.saveCount, persistentData.generation);
+}
+
+bool PublishQueueSpiFlashRK::loadMetadataSector(size_t sectorIndex, PersistentData &data, size_t &offset) {
+    size_t sectorAddr = metadataAddr + sectorIndex * SECTOR_SIZE;
+    bool found = false;
+
+    // Records are appended, so step through them by their size
+    offset = 0;
+    while(offset + 2 * sizeof(uint32_t) <= SECTOR_SIZE) {
+        uint8_t buf[sizeof(PersistentData)];
+        size_t len = SECTOR_SIZE - offset;
+        if (len > sizeof(buf)) {
+            len = sizeof(buf);
+        }
+        spiFlash->readData(sectorAddr + offset, buf, len);
+
+        uint32_t magic, size;
+        memcpy(&magic, &buf[0], sizeof(uint32_t));
+        memcpy(&size, &buf[sizeof(uint32_t)], sizeof(uint32_t));
+        if (magic == 0xffffffff) {
+            // Erased, this is the first free slot
+            break;
+        }
+        if (size < 2 * sizeof(uint32_t) || size > len) {
+            // Interrupted while writing the size, the rest of the sector can't be used
+            offset = SECTOR_SIZE;
+            break;
+        }
+        offset += size;
+
+        PersistentData tempData;
+        if (magic == PERSISTENT_DATA_MAGIC && parseMetadata(buf, size, tempData)) {
+            data = tempData;
+            found = true;
+        }
+    }
+    return found;
+}
+
+// [static]
+bool PublishQueueSpiFlashRK::parseMetadata(const uint8_t *buf, size_t size, PersistentData &data) {
+    if (size != sizeof(PersistentData)) {
+        return false;
+    }
+    memcpy(&data, buf, sizeof(PersistentData));
+    return data.commitMagic == PERSISTENT_DATA_MAGIC && data.crc == Crc32cRK::calculate(&data, offsetof(PersistentData, crc));
+}
+
+void PublishQueueSpiFlashRK::saveMetadata() {
+    if (!hasMetadata) {
+        return;
+    }
+
+    WITH_LOCK(*this) {
+        if (metadataOffset + sizeof(PersistentData) > SECTOR_SIZE) {
+            if (!metadataSpareErased) {
+                // serviceMetadata() erases it from loop() without holding the lock, then saves
+                metadataSaveRequested = true;
+                return;
+            }
+            // Switch to the other sector. The last record in this one is kept until the new one is written.
+            metadataSector = 1 - metadataSector;
+            metadataOffset = 0;
+            metadataSpareErased = false;
+        }
+        metadataSaveRequested = false;
+
+        persistentData.magic = PERSISTENT_DATA_MAGIC;
+        persistentData.size = sizeof(PersistentData);
+        persistentData.version = PERSISTENT_DATA_VERSION;
+        persistentData.saveCount++;
+        persistentData.observedSecs = bootObservedSecs + (uint32_t)(System.millis() / 1000);
+        for(size_t ii = 0; ii < MAX_CONSUMERS; ii++) {
+            // Positions of consumers that are not added are not kept
+            if (ii < consumers.size() && consumers[ii].started) {
+                persistentData.cursors[ii].nameHash = consumers[ii].nameHash;
+                persistentData.cursors[ii].sequence = consumers[ii].sequence;
+            }
+            else {
+                persistentData.cursors[ii].nameHash = 0;
+                persistentData.cursors[ii].sequence = 0;
+            }
+        }
+        persistentData.crc = Crc32cRK::calculate(&persistentData, offsetof(PersistentData, crc));
+        persistentData.commitMagic = PERSISTENT_DATA_MAGIC;
+
+        spiFlash->writeData(metadataAddr + metadataSector * SECTOR_SIZE + metadataOffset, &persistentData, sizeof(PersistentData));
+        metadataOffset += sizeof(PersistentData);
+    }
+}
+
+void PublishQueueSpiFlashRK::serviceMetadata() {
+    if (!hasMetadata) {
+        return;
+    }
+
+    bool erase = false;
+    size_t sectorIndex = 0;
+    WITH_LOCK(*this) {
+        if (!metadataSpareErased) {
+            erase = true;
+            sectorIndex = 1 - metadataSector;
+        }
+    }
+    if (erase) {
+        // saveMetadata() doesn't switch to this sector until it's erased, so the lock is not held and 
+        // publish() from another thread doesn't wait for the erase
+        spiFlash->sectorErase(metadataAddr + sectorIndex * SECTOR_SIZE);
+
+        WITH_LOCK(*this) {
+            metadataSpareErased = true;
+            persistentData.metadataErases++;
+        }
+    }
+
+    bool save;
+    WITH_LOCK(*this) {
+        save = metadataSaveRequested;
+    }
+    if (save) {
+        saveMetadata();
+    }
+}
+
+bool PublishQueueSpiFlashRK::isMetadataSectorErased(size_t sectorIndex) {
+    for(size_t offset = 0; offset < SECTOR_SIZE; ) {
+        uint8_t buf[256];
+        spiFlash->readData(metadataAddr + sectorIndex * SECTOR_SIZE + offset, buf, sizeof(buf));
+        for(size_t ii = 0; ii < sizeof(buf); ii++) {
+            if (buf[ii] != 0xff) {
+                return false;
+            }
+        }
+        offset += sizeof(buf);
+    }
+    return true;
+}
+
+bool PublishQueueSpiFlashRK::formatBuffer() {
+    bool bResult = circBuffer->format();
+
+    WITH_LOCK(*this) {
+        // Formatting erases every sector once
+        persistentData.sectorErases += getNumSectors();
+        persistentData.writeOffset = SECTOR_HEADER_SIZE;
+        persistentData.flashBytes += SECTOR_HEADER_SIZE;
+
+        curEventValid = false;
+        numEvents = 0;
+        numEventsValid = bResult;
+        queuedBytes = 0;
+        persistentData.stalePending = 0;
+    }
+    saveMetadata();
+
+    return bResult;
+}
+
+bool PublishQueueSpiFlashRK::updateWearStats(size_t userBytes, size_t recordSize) {
+    size_t recordBytes = recordSize + RECORD_HEADER_SIZE;
+    bool newSector = false;
+
+    WITH_LOCK(*this) {
+        persistentData.userBytes += userBytes;
+        persistentData.flashBytes += recordBytes;
+
+        if (persistentData.writeOffset + recordBytes > SECTOR_SIZE) {
+            // Record does not fit, the circular buffer erases the next sector and writes it there
+            persistentData.sectorErases++;
+            persistentData.writeOffset = SECTOR_HEADER_SIZE;
+            persistentData.flashBytes += SECTOR_HEADER_SIZE;
+            newSector = true;
+        }
+        persistentData.writeOffset += recordBytes;
+    }
+
+    return newSector;
+}
+
 
 void PublishQueueSpiFlashRK::systemEventHandler(system_event_t event, int param) {
     if ((event == reset) || ((event == cloud_status) && (param == cloud_status_disconnecting))) {
         _log.trace("reset or disconnect event");
+
+        if (event == reset && _instance && _instance->circBuffer) {
+            // publish() returned true for staged events, so write them before resetting
+            _instance->flushStaging();
+            WITH_LOCK(*_instance) {
+                _instance->metadataSaveRequested = true;
+            }
+            _instance->serviceMetadata();
+        }
     }
 }
 
@@ -5,6 +5,9 @@
 
 #include "CircularBufferSpiFlashRK.h"
 
+#include <deque>
+#include <vector>
+
 /**
  * This class is a singleton; you do not create one as a global, on the stack, or with new.
  * 
@@ -16,6 +19,75 @@
  */
 class PublishQueueSpiFlashRK {
 public:
+    /**
+     * @brief Order to publish queued events in, set using withDrainOrder()
+     */
+    enum class DrainOrder {
+        OLDEST_FIRST, //!< Publish events in the order they were queued (default)
+        NEWEST_FIRST //!< Publish recent events first, newest first, then older events in the order they were queued
+    };
+
+    /**
+     * @brief Callback for a consumer added using withConsumer()
+     * 
+     * Return true if the event was handled, or false to have it delivered again on a later loop().
+     */
+    typedef std::function<bool(const char *eventName, const char *eventData)> ConsumerCallback;
+
+    /**
+     * @brief What to do when a consumer added using withConsumer() falls behind
+     */
+    enum class LagPolicy {
+        SKIP, //!< Skip the oldest events the consumer has not handled when it is more than maxLagEvents behind (default)
+        BLOCK //!< publish() returns false instead of queuing an event more than maxLagEvents ahead of the consumer
+    };
+
+    /**
+     * @brief Consumer statistics, returned by getConsumerStats()
+     */
+    class ConsumerStats {
+    public:
+        bool started = false; //!< true if the consumer has handled an event, so sequence is valid
+        uint32_t sequence = 0; //!< Sequence number of the last event handled by the consumer
+        uint32_t delivered = 0; //!< Number of events handled since startup
+        uint32_t skipped = 0; //!< Number of events skipped since startup, because of LagPolicy::SKIP or because they were discarded
+        uint32_t lag = 0; //!< Number of queued events the consumer has not handled yet
+    };
+
+    /**
+     * @brief Wear and write amplification statistics, returned by getWearStats()
+     * 
+     * The circular buffer erase counts are estimated from a single running total, not counted per 
+     * sector, see getWearStats().
+     */
+    class WearStats {
+    public:
+        size_t numSectors = 0; //!< Number of sectors in the circular buffer
+        uint32_t sectorErases = 0; //!< Estimated total number of circular buffer sector erases since tracking began
+        uint32_t eraseCount = 0; //!< Estimated erases per circular buffer sector, sectorErases / numSectors
+        uint32_t metadataEraseCount = 0; //!< Erases of the more worn of the two metadata sectors
+        uint64_t userBytes = 0; //!< Number of event name and data bytes enqueued
+        uint64_t flashBytes = 0; //!< Estimated number of bytes programmed to flash, including encoding and headers
+        float writeAmplification = 0.0; //!< flashBytes / userBytes, or 0 if nothing has been enqueued
+        uint32_t observedSecs = 0; //!< Number of seconds of run time the enqueue rate is based on
+        float projectedLifetimeDays = 0.0; //!< Run time until a circular buffer or metadata sector reaches the flash endurance, or 0 if unknown
+    };
+
+    /**
+     * @brief Enqueue latency statistics, returned by getEnqueueStats()
+     * 
+     * Latencies are kept in a histogram with power-of-two buckets, so the percentiles are the
+     * upper bound of the bucket the percentile falls in.
+     */
+    class EnqueueStats {
+    public:
+        uint32_t count = 0; //!< Number of calls to publishCommon
+        uint32_t stagedCount = 0; //!< Number of events staged in RAM and written to flash from loop()
+        uint32_t p50Micros = 0; //!< Median time spent in publishCommon, in microseconds
+        uint32_t p99Micros = 0; //!< 99th percentile time spent in publishCommon, in microseconds
+        uint32_t maxMicros = 0; //!< Longest time spent in publishCommon, in microseconds
+    };
+
     /**
      * @brief Gets the singleton instance of this class, allocating it if necessary
      * 
@@ -34,6 +106,124 @@ public:
      */
     PublishQueueSpiFlashRK &withSpiFlash(SpiFlash *spiFlash, size_t addrStart, size_t addrEnd);
 
+    /**
+     * @brief Sets two sectors used to store queue metadata, such as wear statistics, across restarts
+     * 
+     * @param addr Address of the first sector. The second sector follows it. Must be sector aligned, 
+     * and neither sector can be within addrStart to addrEnd.
+     * @return PublishQueueSpiFlashRK& 
+     * 
+     * This is optional. Without a metadata sector the wear statistics start over at every restart.
+     * The metadata is appended to a sector in small records, so a sector is only erased after many 
+     * updates. The two sectors are used alternately, so the previous record is kept until the first 
+     * record is written to the other sector. The other sector is then erased from loop() without 
+     * holding the lock, so a save never waits for an erase. Saves needed by publish() are done from
+     * loop() too.
+     */
+    PublishQueueSpiFlashRK &withMetadataSector(size_t addr) { metadataAddr = addr; hasMetadata = true; return *this; };
+
+    /**
+     * @brief Sets the rated erase cycles of the flash chip, used to calculate projected lifetime
+     * 
+     * @param cycles Number of erase cycles per sector. The default is 100000.
+     * @return PublishQueueSpiFlashRK& 
+     */
+    PublishQueueSpiFlashRK &withFlashEndurance(uint32_t cycles) { flashEndurance = cycles; return *this; };
+
+    /**
+     * @brief Sets the maximum time spent in each loop() discarding events removed by clearQueues()
+     * 
+     * @param ms Time in milliseconds. The default is 10.
+     * @return PublishQueueSpiFlashRK& 
+     */
+    PublishQueueSpiFlashRK &withReclaimBudgetMs(unsigned long ms) { reclaimBudgetMs = ms; return *this; };
+
+    /**
+     * @brief Sets the size of a RAM buffer for events waiting to be written to flash from loop()
+     * 
+     * @param bytes Size in bytes. The default is 0, which disables staging.
+     * @return PublishQueueSpiFlashRK& 
+     * 
+     * When an event doesn't fit in the current sector, the circular buffer erases the next sector 
+     * while writing it, which can take tens to hundreds of milliseconds. CircularBufferSpiFlashRK 
+     * doesn't report its write position, so which write will do this isn't known in advance. With 
+     * staging, every event is saved in RAM and written to flash from the next loop(), so publish() 
+     * does not wait for flash writes or erases.
+     * 
+     * This moves the writes, it doesn't remove them: the next loop() takes that time instead. Staged
+     * events are written on System.reset(), but are lost on power loss or a crash before loop() runs.
+     * If the staging buffer fills before loop() runs, publish() returns false instead of writing 
+     * the event ahead of the staged ones. An event larger than the staging buffer is written directly
+     * if nothing is staged, otherwise publish() returns false.
+     * 
+     * Call before setup(). The buffer is allocated from the heap by setup().
+     */
+    PublishQueueSpiFlashRK &withStagingSize(size_t bytes) { stagingSize = bytes; return *this; };
+
+    /**
+     * @brief Sets the order to publish queued events in
+     * 
+     * @param order DrainOrder::OLDEST_FIRST (default) or DrainOrder::NEWEST_FIRST
+     * @param liveEventsMax Number of recent events to keep in RAM for NEWEST_FIRST. The default is 10.
+     * @return PublishQueueSpiFlashRK& 
+     * 
+     * With NEWEST_FIRST, a copy of the most recent events queued since startup is kept in RAM. These are 
+     * published first, newest first, so current values are sent as soon as the device reconnects after
+     * an outage. The older events are then published from the circular buffer in the order they were
+     * queued, waiting withWaitBetweenHistoryPublish() between them. A new event queued while the older 
+     * events are being published is sent after waitBetweenPublish instead of waiting behind them.
+     * 
+     * Events are not rewritten in flash. Each event includes a sequence number, and events that were 
+     * published from RAM are skipped when reached in the circular buffer. If the device resets after 
+     * publishing an event from RAM, that event may be published a second time. Up to SKIP_SEQUENCES_MAX
+     * events published from RAM can be waiting to be skipped; after that, events are published in
+     * order from flash until older events catch up.
+     */
+    PublishQueueSpiFlashRK &withDrainOrder(DrainOrder order, size_t liveEventsMax = 10) { drainOrder = order; this->liveEventsMax = liveEventsMax; return *this; };
+
+    /**
+     * @brief Sets how long to wait between publishing older events when using DrainOrder::NEWEST_FIRST
+     * 
+     * @param ms Time in milliseconds. The default is 2000.
+     * @return PublishQueueSpiFlashRK& 
+     */
+    PublishQueueSpiFlashRK &withWaitBetweenHistoryPublish(unsigned long ms) { waitBetweenHistoryPublish = ms; return *this; };
+
+    /**
+     * @brief Adds a consumer that receives every queued event, in addition to publishing to the cloud
+     * 
+     * @param name Name of the consumer, used to find its position after a restart. Must be unique.
+     * @param callback Function to call from loop() with each event. Return true if the event was handled.
+     * @param lagPolicy LagPolicy::SKIP (default) or LagPolicy::BLOCK
+     * @param maxLagEvents Number of events the consumer can fall behind before lagPolicy applies, or 0 for no limit
+     * @return PublishQueueSpiFlashRK& 
+     * 
+     * This is used to deliver the same events to a local logger or a BLE connection without writing
+     * them to flash more than once. Up to MAX_CONSUMERS consumers can be added, typically before setup().
+     * Consumers require withMetadataSector().
+     * 
+     * Each consumer keeps its own position, the sequence number of the last event it handled, separate 
+     * from publishing to the cloud. Publishing never waits for consumers. Positions are saved in the 
+     * metadata sector so a consumer continues where it left off after a restart, though the last few 
+     * events may be delivered again. A new consumer starts with the oldest event not yet published to 
+     * the cloud.
+     * 
+     * Recent events are delivered from the RAM copy also used by DrainOrder::NEWEST_FIRST (see 
+     * withDrainOrder() to set its size), including while offline. Older events can only be read from
+     * flash when they're the oldest queued event, so a consumer that falls further behind than that
+     * gets them as the cloud publishes them, and waits while offline. Events that were already published 
+     * to the cloud and are no longer in RAM, such as after a restart, are skipped. Set the size of the
+     * RAM copy to the number of events a consumer may fall behind while offline.
+     * 
+     * Marking an event as published doesn't free space in flash. The circular buffer only reuses a 
+     * sector when it's full, discarding the oldest events whether or not they have been published or 
+     * handled. With LagPolicy::SKIP, events discarded before the consumer handled them are skipped, and
+     * if maxLagEvents is set the consumer also skips ahead when it falls further behind than that. With 
+     * LagPolicy::BLOCK, publish() returns false while the consumer is maxLagEvents behind; set it to 
+     * fewer events than the circular buffer holds so events are not discarded before it handles them.
+     */
+    PublishQueueSpiFlashRK &withConsumer(const char *name, ConsumerCallback callback, LagPolicy lagPolicy = LagPolicy::SKIP, size_t maxLagEvents = 0);
+
 
     /**
      * @brief Adds a callback function to call with publish is complete
@@ -157,7 +347,15 @@ public:
 	virtual bool publishCommon(const char *eventName, const char *data, int ttl, PublishFlags flags1, PublishFlags flags2 = PublishFlags());
 
     /**
-     * @brief Empty both the RAM and file based queues. Any queued events are discarded. 
+     * @brief Empty the queue. Any queued events are discarded. 
+     * 
+     * If a metadata sector is configured using withMetadataSector(), this returns immediately. The
+     * generation number in the metadata is incremented, and events from earlier generations are marked 
+     * as read from loop() a few at a time, limited by withReclaimBudgetMs(). Those events are never
+     * published, even after a reset. They are not counted here; getNumEvents() only includes them if
+     * it has to count the circular buffer again before they're all marked as read, such as after a reset.
+     * 
+     * Without a metadata sector, the circular buffer is formatted, which erases every sector before returning.
      */
     void clearQueues();
 
@@ -192,14 +390,64 @@ public:
     /**
      * @brief Gets the total number of events queued
      * 
-     * This is the number of events in the RAM-based queue and the file-based
-     * queue. This operation is fast; the file queue length is stored in RAM,
-     * so this command does not need to access the file system.
+     * This operation is fast; the queue length is cached in RAM and only read from
+     * the circular buffer after startup, clearing, or after writing an event while the 
+     * buffer is at least half full, when a write may discard the oldest events.
      * 
      * If an event is currently being sent, the result includes this event.
      */
     size_t getNumEvents();
 
+    /**
+     * @brief Gets wear and write amplification statistics for the circular buffer
+     * 
+     * @param stats Filled in with the statistics
+     * @return true if the statistics are available, false if setup() has not been called
+     * 
+     * There are no per-sector erase counters. CircularBufferSpiFlashRK does not report its write 
+     * position, so the bytes written are modeled from the size of each record and an approximate 
+     * per-record and per-sector overhead, and every time the model fills a sector the total is 
+     * incremented. The circular buffer writes its sectors in turn, so each one is erased about 
+     * sectorErases / numSectors times. Writes since the last metadata save are lost if the device 
+     * loses power, so this is an estimate, not a count.
+     * 
+     * The two metadata sectors are erased alternately when the one being written fills up. These
+     * erases are counted exactly, and with small events they can wear faster than the circular buffer.
+     * 
+     * The projected lifetime is the shorter of the circular buffer and metadata sector lifetimes, 
+     * based on the rates observed so far and the value set using withFlashEndurance(). It counts run 
+     * time only, not time powered down.
+     */
+    bool getWearStats(WearStats &stats);
+
+    /**
+     * @brief Gets statistics about how long publish calls take to queue an event
+     * 
+     * @param stats Filled in with the statistics
+     * @return true 
+     */
+    bool getEnqueueStats(EnqueueStats &stats);
+
+    /**
+     * @brief Gets the number of events discarded since startup because they failed the CRC check
+     * 
+     * Each event is stored with a CRC-32C of its data. Events that don't match are discarded without
+     * attempting to publish them. Events written by earlier versions of this library don't have a CRC
+     * and are not checked.
+     */
+    uint32_t getCorruptEvents() const { return corruptEvents; };
+
+    /**
+     * @brief Gets the position and statistics of a consumer added using withConsumer()
+     * 
+     * @param name Name of the consumer
+     * @param stats Filled in with the statistics
+     * @return true if the consumer was found
+     */
+    bool getConsumerStats(const char *name, ConsumerStats &stats);
+
+    static const size_t MAX_CONSUMERS = 4; //!< Maximum number of consumers added using withConsumer()
+
     /**
      * @brief Locks the mutex that protects shared resources
      * 
@@ -246,6 +494,378 @@ protected:
     PublishQueueSpiFlashRK& operator=(const PublishQueueSpiFlashRK&) = delete;
 
 
+    /**
+     * @brief Position of a consumer, stored in PersistentData
+     */
+    struct ConsumerCursor {
+        uint32_t nameHash; //!< CRC-32C of the consumer name, or 0 for an unused entry
+        uint32_t sequence; //!< Sequence number of the last event handled by the consumer
+    };
+
+    /**
+     * @brief Structure stored in the metadata sector
+     * 
+     * Each update is appended after the last one. commitMagic is the last field written, so
+     * a write interrupted by a reset is ignored when loading.
+     * 
+     * Fields are only ever added by using reserved words, so the size stays the same and older
+     * records load with the new fields set to 0.
+     */
+    struct PersistentData {
+        uint32_t magic; //!< PERSISTENT_DATA_MAGIC
+        uint32_t size; //!< sizeof(PersistentData)
+        uint32_t writeOffset; //!< Modeled offset of the next record within the circular buffer sector being written
+        uint32_t sectorErases; //!< Estimated total number of circular buffer sector erases
+        uint32_t metadataErases; //!< Total number of metadata sector erases
+        uint32_t observedSecs; //!< Run time in seconds, used for calculating rates
+        uint32_t generation; //!< Incremented by clearQueues(). Events from earlier generations are discarded.
+        uint32_t stalePending; //!< Nonzero if events from earlier generations may not be marked as read yet
+        uint64_t userBytes; //!< Event name and data bytes enqueued
+        uint64_t flashBytes; //!< Bytes programmed to flash
+        uint32_t sequence; //!< Sequence numbers below this may have been used
+        ConsumerCursor cursors[MAX_CONSUMERS]; //!< Positions of consumers added using withConsumer()
+        uint32_t version; //!< PERSISTENT_DATA_VERSION when written
+        uint32_t saveCount; //!< Incremented on each save, to find the newest record in the two metadata sectors
+        uint32_t reserved[7]; //!< Reserved for future use (0)
+        uint32_t crc; //!< CRC-32C of the fields before this one
+        uint32_t commitMagic; //!< PERSISTENT_DATA_MAGIC, written last
+    };
+
+    /**
+     * @brief Loads the most recent PersistentData from the metadata sectors
+     * 
+     * If there are no metadata sectors, or they do not contain valid data, persistentData is left
+     * at its default values.
+     */
+    void loadMetadata();
+
+    /**
+     * @brief Finds the last valid PersistentData in one of the metadata sectors
+     * 
+     * @param sectorIndex 0 or 1
+     * 
+     * @param data Filled in with the last valid record
+     * 
+     * @param offset Filled in with the offset of the first free byte in the sector
+     * 
+     * @return true if a valid record was found
+     */
+    bool loadMetadataSector(size_t sectorIndex, PersistentData &data, size_t &offset);
+
+    /**
+     * @brief Appends persistentData to the current metadata sector, or to the other sector if full
+     * 
+     * This never erases a sector. If the other sector has not been erased yet by serviceMetadata(),
+     * the save is done from loop() after erasing it.
+     */
+    void saveMetadata();
+
+    /**
+     * @brief Erases the metadata sector not being written, if necessary, and does a requested save; called from loop()
+     */
+    void serviceMetadata();
+
+    /**
+     * @brief Returns true if every byte of a metadata sector is erased
+     * 
+     * @param sectorIndex 0 or 1
+     */
+    bool isMetadataSectorErased(size_t sectorIndex);
+
+    /**
+     * @brief Validates a record read from the metadata sector
+     * 
+     * @param buf The record, starting with magic
+     * 
+     * @param size The size field of the record
+     * 
+     * @param data Filled in with the record
+     * 
+     * @return true if the record is valid
+     */
+    static bool parseMetadata(const uint8_t *buf, size_t size, PersistentData &data);
+
+    /**
+     * @brief Formats the circular buffer and updates the wear statistics
+     */
+    bool formatBuffer();
+
+    /**
+     * @brief Updates the wear statistics after writing a record to the circular buffer
+     * 
+     * @param userBytes Number of bytes of event name and data
+     * 
+     * @param recordSize Number of bytes passed to CircularBufferSpiFlashRK::writeData
+     * 
+     * @return true if the write position moved into a new sector
+     */
+    bool updateWearStats(size_t userBytes, size_t recordSize);
+
+    /**
+     * @brief Marks curEvent as read in the circular buffer and updates the cached state
+     */
+    void markEventRead();
+
+    /**
+     * @brief Marks events from earlier generations as read, until none are left or reclaimBudgetMs elapses
+     * 
+     * This is called from loop(), except while a publish is in progress.
+     */
+    void reclaimStaleEvents();
+
+    /**
+     * @brief Event fields parsed from the JSON stored in the circular buffer
+     */
+    class EventInfo {
+    public:
+        String name; //!< Event name
+        String data; //!< Event data
+        PublishFlags flags; //!< NO_ACK and WITH_ACK flags
+        uint32_t generation = 0; //!< Generation, see clearQueues()
+        uint32_t sequence = 0; //!< Sequence number, if hasSequence is true
+        bool hasSequence = false; //!< true if the event includes a sequence number
+    };
+
+    /**
+     * @brief A recent event kept in RAM for DrainOrder::NEWEST_FIRST and consumers
+     */
+    class LiveEvent {
+    public:
+        uint32_t sequence; //!< Sequence number of the event
+        String json; //!< Event JSON, the same as is stored in the circular buffer
+        bool published = false; //!< true if the event has been published to the cloud
+    };
+
+    /**
+     * @brief A consumer added using withConsumer()
+     */
+    class Consumer {
+    public:
+        String name; //!< Name of the consumer
+        uint32_t nameHash = 0; //!< CRC-32C of name, used to find the position in PersistentData
+        ConsumerCallback callback; //!< Function to call with each event
+        LagPolicy lagPolicy = LagPolicy::SKIP; //!< What to do when the consumer falls behind
+        size_t maxLagEvents = 0; //!< Number of events the consumer can fall behind before lagPolicy applies, 0 for no limit
+        bool started = false; //!< true if sequence is valid
+        uint32_t sequence = 0; //!< Sequence number of the last event handled
+        uint32_t delivered = 0; //!< Number of events handled since startup
+        uint32_t skipped = 0; //!< Number of events skipped since startup
+    };
+
+    /**
+     * @brief Where the event being published came from
+     */
+    enum class PublishSource {
+        QUEUE, //!< curEvent, from the circular buffer
+        LIVE //!< liveEvents
+    };
+
+    /**
+     * @brief Checks the CRC-32C of an event read from the circular buffer
+     * 
+     * @return true if the CRC matches, or the event was written without a CRC
+     */
+    static bool verifyEvent(const CircularBufferSpiFlashRK::ReadInfo &readInfo);
+
+    /**
+     * @brief Parses the JSON for an event as stored in the circular buffer
+     * 
+     * @param json The event JSON
+     * 
+     * @param eventInfo Filled in with the event fields. Fields not in the JSON are left unchanged.
+     */
+    static void parseEvent(const char *json, EventInfo &eventInfo);
+
+    /**
+     * @brief Starts publishing an event and goes into statePublishWait
+     */
+    void startPublish(const EventInfo &eventInfo);
+
+    /**
+     * @brief Sets nextSequence, reserving a block of sequence numbers in the metadata
+     * 
+     * This is done in setup() if sequence numbers are used, otherwise by loop() or the first publish().
+     */
+    void initSequence();
+
+    /**
+     * @brief Gets the sequence number for a new event
+     * 
+     * With a metadata sector, sequence numbers are reserved in blocks of SEQUENCE_RESERVE so they
+     * increase across restarts without saving the metadata for every event. The next block is 
+     * reserved when half of the current one is used and saved from loop(), so more than 
+     * SEQUENCE_RESERVE / 2 events queued without loop() running could reuse numbers after a power loss.
+     */
+    uint32_t getNextSequence();
+
+    /**
+     * @brief Marks events in liveEvents as published to the cloud and removes those no longer needed
+     * 
+     * @param sequence Sequence number of the event
+     * 
+     * @param andEarlier true to also mark events with earlier sequence numbers
+     */
+    void setLivePublished(uint32_t sequence, bool andEarlier);
+
+    /**
+     * @brief Removes events from liveEvents that are no longer needed for publishing or by any consumer
+     */
+    void pruneLiveEvents();
+
+    /**
+     * @brief Reads the oldest event into curEvent and curEventInfo, if not already read
+     * 
+     * Events that fail the CRC check are discarded.
+     * 
+     * @return true if curEvent is valid, false if the queue is empty
+     */
+    bool readHead();
+
+    /**
+     * @brief Delivers at most one event to each consumer; called from loop()
+     */
+    void serviceConsumers();
+
+    /**
+     * @brief Sets the position of a new consumer to before the oldest event not published to the cloud
+     */
+    void startConsumer(Consumer &consumer);
+
+    /**
+     * @brief Gets the first event after the position of a consumer
+     * 
+     * @param consumer The consumer
+     * 
+     * @param eventInfo Filled in with the event
+     * 
+     * @return true if there is an event, false if the consumer has handled all events or has to wait
+     * 
+     * Events are taken from liveEvents or, for older events, from the oldest event in the circular 
+     * buffer using readHead(). CircularBufferSpiFlashRK can only read its oldest record, so an older
+     * event that is not the oldest one is not delivered until the cloud publishes the events before it.
+     */
+    bool getConsumerEvent(Consumer &consumer, EventInfo &eventInfo);
+
+    /**
+     * @brief Moves a consumer past events it will not get, counting them as skipped
+     */
+    void skipConsumer(Consumer &consumer, uint32_t sequence);
+
+    /**
+     * @brief Returns the number of events queued after the position of a consumer
+     * 
+     * Sequence numbers skip the unused part of a reserved block after a restart, so this is limited
+     * to the number of events queued in flash, staged, or in liveEvents.
+     */
+    uint32_t getConsumerLag(const Consumer &consumer) const;
+
+    /**
+     * @brief Returns true if a consumer with LagPolicy::BLOCK is too far behind to queue another event
+     */
+    bool isConsumerBlocking() const;
+
+    /**
+     * @brief Sets the position of a consumer from PersistentData, if it was saved
+     */
+    void restoreConsumer(Consumer &consumer);
+
+    /**
+     * @brief Returns true if events need sequence numbers and recent events need to be kept in RAM
+     */
+    bool useSequence() const { return drainOrder == DrainOrder::NEWEST_FIRST || !consumers.empty(); };
+
+    /**
+     * @brief Returns true if events from this generation were discarded by clearQueues()
+     * 
+     * Events from later generations than the current one are not discarded. This can only
+     * happen if the metadata was lost, and readHead() then moves to the later generation.
+     */
+    bool isStaleGeneration(uint32_t generation) const { return isSequenceBefore(generation, persistentData.generation); };
+
+    /**
+     * @brief Returns true if sequence number a is before b, allowing for wrapping
+     */
+    static bool isSequenceBefore(uint32_t a, uint32_t b) { return (int32_t)(a - b) < 0; };
+
+    /**
+     * @brief Removes this sequence number, and any earlier ones, from skipSequences
+     * 
+     * @return true if sequence was in skipSequences
+     */
+    bool removeSkipSequence(uint32_t sequence);
+
+    /**
+     * @brief Writes the JSON record for an event, followed by its CRC, to buf
+     * 
+     * @param buf Buffer to write to
+     * @param size Size of buf. The JSON is truncated if it doesn't fit.
+     * @param eventName Event name
+     * @param data Event data, not NULL
+     * @param flags NO_ACK and WITH_ACK are stored
+     * @param sequence Sequence number, stored if useSequence()
+     * 
+     * @return Number of bytes in the record, including the null terminator and CRC
+     * 
+     * The lock must be held so the generation matches the sequence number.
+     */
+    size_t formatRecord(char *buf, size_t size, const char *eventName, const char *data, PublishFlags flags, uint32_t sequence);
+
+    /**
+     * @brief Adds a queued event to liveEvents and updates lastQueuedSequence, if sequence numbers are used
+     * 
+     * The lock must be held, in the same section that assigns the sequence number.
+     */
+    void addLiveEvent(uint32_t sequence, const char *json);
+
+    /**
+     * @brief Removes an event added by addLiveEvent() whose write failed
+     */
+    void removeLiveEvent(uint32_t sequence);
+
+    /**
+     * @brief Updates the cached state after writing a record to the circular buffer
+     * 
+     * @param recordSize Number of bytes passed to CircularBufferSpiFlashRK::writeData
+     * 
+     * Once the buffer may be full, each write may discard the oldest sector, so the cache is invalidated.
+     */
+    void addQueuedRecord(size_t recordSize);
+
+    /**
+     * @brief Discards the cached event count and event so they will be read again from the circular buffer
+     * 
+     * This is used when the circular buffer may have changed without going through this class,
+     * such as when it discards the oldest sector because it's full.
+     */
+    void invalidateCache();
+
+    /**
+     * @brief Writes the events in the staging buffer to the circular buffer
+     * 
+     * This is called from loop() so the sector erase is not done from publishCommon. The lock
+     * is not held while writing.
+     */
+    void flushStaging();
+
+    /**
+     * @brief Adds a publishCommon duration to the latency histogram
+     * 
+     * @param micros Duration in microseconds
+     */
+    void addEnqueueLatency(uint32_t micros);
+
+    /**
+     * @brief Gets the latency in microseconds at a percentile of the histogram
+     * 
+     * @param percent Percentile, 0 to 100
+     */
+    uint32_t getEnqueueLatencyPercentile(uint32_t percent) const;
+
+    /**
+     * @brief Gets the number of sectors in the circular buffer
+     */
+    size_t getNumSectors() const { return (addrEnd - addrStart) / SECTOR_SIZE; };
+
     /**
      * @brief Callback for BackgroundPublishRK library
      */
@@ -281,22 +901,78 @@ protected:
      */
     os_mutex_recursive_t mutex = 0;
 
+    /**
+     * @brief Mutex held while writing an event to the circular buffer outside of the lock
+     * 
+     * This keeps events in sequence order in flash. It's always locked before mutex, never while
+     * holding it. Created in setup().
+     */
+    os_mutex_recursive_t writeMutex = 0;
+
     SpiFlash *spiFlash = nullptr; //!< SpiFlash object to interface with the flash chip 
     size_t addrStart = 0; //!< Address to start in the chip, must be sector aligned
     size_t addrEnd = 0; //!< Address to end in the chip (exclusive), must be sector aligned
     CircularBufferSpiFlashRK *circBuffer = nullptr; //!< Object to manage the circular buffer
 
+    bool hasMetadata = false; //!< true if withMetadataSector() was called
+    size_t metadataAddr = 0; //!< Address of the metadata sector
+    size_t metadataSector = 0; //!< Metadata sector being written, 0 or 1
+    size_t metadataOffset = 0; //!< Offset of the next free byte in metadataSector
+    bool metadataSpareErased = false; //!< true if the metadata sector not being written is erased, so saveMetadata() can switch to it
+    bool metadataSaveRequested = false; //!< true if saveMetadata() is to be called from loop()
+    uint32_t flashEndurance = 100000; //!< Rated erase cycles per sector
+    uint32_t bootObservedSecs = 0; //!< observedSecs loaded from the metadata sector at boot
+    PersistentData persistentData; //!< Wear statistics, saved in the metadata sector
+
     unsigned long stateTime = 0; //!< millis() value when entering the state, used for stateWait
     unsigned long durationMs = 0; //!< how long to wait before publishing in milliseconds, used in stateWait
     bool publishComplete = false; //!< true if the publish has completed (successfully or not)
     bool publishSuccess = false; //!< true if the publish succeeded
+    bool publishInProgress = false; //!< true from starting a publish until statePublishWait handles the result
     bool pausePublishing = false; //!< flag to pause publishing (used from automated test)
     bool canSleep = false; //!< returns true if this is a good time to go to sleep
     CircularBufferSpiFlashRK::ReadInfo curEvent; //!< Event that is currently being processed
+    bool curEventValid = false; //!< true if curEvent contains the oldest event, so it doesn't need to be read again
+    uint32_t curEventGeneration = 0; //!< Generation of curEvent
+    EventInfo curEventInfo; //!< Fields of curEvent
+    size_t numEvents = 0; //!< Cached number of events in the circular buffer
+    bool numEventsValid = false; //!< true if numEvents is valid
+    bool numEventsIncludesStale = false; //!< true if numEvents was counted while stale events were still queued
+    size_t queuedBytes = 0; //!< Bytes of record data in the circular buffer, updated with numEvents
 
     unsigned long waitAfterConnect = 2000; //!< time to wait after Particle.connected() before publishing
     unsigned long waitBetweenPublish = 1000; //!< how long to wait in milliseconds between publishes
     unsigned long waitAfterFailure = 30000; //!< how long to wait after failing to publish before trying again
+    unsigned long waitBetweenHistoryPublish = 2000; //!< how long to wait between publishing older events with DrainOrder::NEWEST_FIRST
+    unsigned long liveDurationMs = 0; //!< how long to wait before publishing from liveEvents in milliseconds, used in stateWait
+    unsigned long reclaimBudgetMs = 10; //!< maximum time in each loop() to mark events discarded by clearQueues() as read
+
+    size_t stagingSize = 0; //!< Size of stagingBuf in bytes, 0 to disable staging
+    uint8_t *stagingBuf = nullptr; //!< Events waiting to be written from loop(), each preceded by a 2-byte length
+    size_t stagingUsed = 0; //!< Number of bytes used in stagingBuf
+    size_t stagingCount = 0; //!< Number of events in stagingBuf
+    bool flushInProgress = false; //!< true while flushStaging() is writing events
+    uint32_t stagingClears = 0; //!< Incremented when clearQueues() empties stagingBuf
+
+    static const size_t LATENCY_BUCKETS = 24; //!< Number of power-of-two buckets in enqueueLatency, up to 8 seconds
+    uint32_t enqueueLatency[LATENCY_BUCKETS] = {0}; //!< Histogram of publishCommon durations. Bucket n is less than 2^n microseconds.
+    uint32_t enqueueCount = 0; //!< Number of calls to publishCommon
+    uint32_t enqueueStagedCount = 0; //!< Number of events staged
+    uint32_t enqueueMaxMicros = 0; //!< Longest publishCommon duration in microseconds
+
+    DrainOrder drainOrder = DrainOrder::OLDEST_FIRST; //!< Order to publish events in
+    size_t liveEventsMax = 10; //!< Maximum size of liveEvents
+    std::deque<LiveEvent> liveEvents; //!< Most recent events, oldest first, for DrainOrder::NEWEST_FIRST and consumers
+    std::vector<uint32_t> skipSequences; //!< Sequence numbers published from liveEvents that are still in the circular buffer
+    uint32_t nextSequence = 0; //!< Sequence number for the next event
+    bool sequenceValid = false; //!< true if initSequence() has set nextSequence
+    uint32_t curLiveSequence = 0; //!< Sequence number of the live event being published
+    PublishSource publishSource = PublishSource::QUEUE; //!< Where the event being published came from
+    uint32_t corruptEvents = 0; //!< Number of events that failed the CRC check
+    std::vector<Consumer> consumers; //!< Consumers added using withConsumer()
+    size_t cursorChanges = 0; //!< Number of consumer position changes since the metadata was saved
+    uint32_t lastQueuedSequence = 0; //!< Sequence number of the newest event queued, used for consumer lag
+    uint32_t liveEventsFloor = 0; //!< Events queued after this sequence number are all in liveEvents, unless consumers have handled them
 
     std::function<void(bool succeeded, const char *eventName, const char *eventData)> publishCompleteUserCallback = 0; //!< User callback for publish complete
 
@@ -305,6 +981,15 @@ protected:
 
     static void systemEventHandler(system_event_t event, int param); //!< system event handler, used to detect reset events
 
+    static const size_t SECTOR_SIZE = 4096; //!< Flash sector size in bytes
+    static const size_t SECTOR_HEADER_SIZE = 12; //!< Approximate per-sector overhead of the circular buffer, used for wear statistics
+    static const size_t RECORD_HEADER_SIZE = 4; //!< Approximate per-record overhead of the circular buffer, used for wear statistics
+    static const uint32_t PERSISTENT_DATA_MAGIC = 0x5170f1a5; //!< Magic bytes for PersistentData
+    static const uint32_t PERSISTENT_DATA_VERSION = 1; //!< Version of the PersistentData layout
+    static const uint32_t SEQUENCE_RESERVE = 1024; //!< Number of sequence numbers reserved each time the metadata is saved
+    static const size_t SKIP_SEQUENCES_MAX = 256; //!< Maximum size of skipSequences
+    static const size_t CURSOR_SAVE_INTERVAL = 32; //!< Number of consumer position changes before saving the metadata
+
     /**
      * @brief Singleton instance of this class
      * 
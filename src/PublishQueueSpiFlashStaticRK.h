@@ -0,0 +1,813 @@
+#ifndef __PUBLISHQUEUESPIFLASHSTATICRK_H
+#define __PUBLISHQUEUESPIFLASHSTATICRK_H
+
+#include "Particle.h"
+
+#include "SpiFlashRK.h"
+
+/**
+ * @brief Default limits and timings for PublishQueueSpiFlashStaticRK
+ *
+ * To change them, derive a struct from this one and override the values you want to change:
+ *
+ * ```
+ * struct MyQueueConfig : public PublishQueueSpiFlashStaticConfig {
+ *     static constexpr size_t maxEventDataSize = 256;
+ * };
+ * PublishQueueSpiFlashStaticRK<MyQueueConfig> publishQueue;
+ * ```
+ */
+struct PublishQueueSpiFlashStaticConfig {
+    static constexpr size_t maxEventNameSize = 64; //!< Maximum event name length, not including the null terminator
+    static constexpr size_t maxEventDataSize = 1024; //!< Maximum event data length, not including the null terminator
+    static constexpr unsigned long waitAfterConnectMs = 2000; //!< time to wait after Particle.connected() before publishing
+    static constexpr unsigned long waitBetweenPublishMs = 1000; //!< how long to wait in milliseconds between publishes
+    static constexpr unsigned long waitAfterFailureMs = 30000; //!< how long to wait after failing to publish before trying again
+};
+
+/**
+ * @brief Publish queue on SPI flash that does not allocate memory from the heap itself
+ *
+ * This is an alternative to PublishQueueSpiFlashRK for devices with little free RAM. It does not
+ * use CircularBufferSpiFlashRK, BackgroundPublishRK, String, or std::function. All of the RAM it
+ * uses is in the object itself, so it's fixed at compile time: sizeof(PublishQueueSpiFlashStaticRK<Config>),
+ * which is Config::maxEventNameSize + Config::maxEventDataSize plus approximately 100 bytes. Declare
+ * it as a global variable:
+ *
+ * ```
+ * PublishQueueSpiFlashStaticRK<> publishQueue;
+ * ```
+ *
+ * From global application setup you must call:
+ * publishQueue.withSpiFlash(&spiFlash, 0, 100 * 4096).setup();
+ *
+ * From global application loop you must call:
+ * publishQueue.loop();
+ *
+ * The flash format is not compatible with PublishQueueSpiFlashRK; don't use both on the same
+ * portion of the flash chip. Each sector has a small header and contains as many events as fit. Events
+ * are not split across sectors.
+ *
+ * Events are published from loop() using spark_send_event() with a completion callback, instead of
+ * Particle.publish(), which allocates the shared state of the Future it returns from the heap.
+ * Publishing can block loop() for a while, for example while the cloud connection is busy. 
+ * PublishQueueSpiFlashRK avoids this by publishing from a BackgroundPublishRK thread, which has its
+ * own heap-allocated stack.
+ */
+template<class Config = PublishQueueSpiFlashStaticConfig>
+class PublishQueueSpiFlashStaticRK {
+public:
+    /**
+     * @brief Size of the buffer used to hold the event being published
+     */
+    static constexpr size_t STAGING_SIZE = Config::maxEventNameSize + 1 + Config::maxEventDataSize + 1;
+
+    /**
+     * @brief Callback function type for withPublishCompleteUserCallback
+     *
+     * This is a plain function pointer instead of std::function so it cannot allocate memory.
+     */
+    typedef void (*PublishCompleteCallback)(bool succeeded, const char *eventName, const char *eventData);
+
+    /**
+     * @brief Constructor. Typically you declare this object as a global variable.
+     */
+    PublishQueueSpiFlashStaticRK() : _log("app.pubq") {};
+
+    /**
+     * This class cannot be copied
+     */
+    PublishQueueSpiFlashStaticRK(const PublishQueueSpiFlashStaticRK&) = delete;
+
+    /**
+     * This class cannot be copied
+     */
+    PublishQueueSpiFlashStaticRK& operator=(const PublishQueueSpiFlashStaticRK&) = delete;
+
+    /**
+     * @brief Sets the flash chip and the portion of it to use
+     *
+     * @param spiFlash The SpiFlashRK object for the SPI NOR flash chip.
+     * @param addrStart Address to start at (typically 0). Must be sector aligned (multiple of 4096 bytes).
+     * @param addrEnd Address to end at (not inclusive). Must be sector aligned (multiple of 4096 bytes).
+     * There must be at least two sectors.
+     * @return PublishQueueSpiFlashStaticRK&
+     */
+    PublishQueueSpiFlashStaticRK &withSpiFlash(SpiFlash *spiFlash, size_t addrStart, size_t addrEnd) {
+        this->spiFlash = spiFlash;
+        this->addrStart = addrStart;
+        this->addrEnd = addrEnd;
+        return *this;
+    };
+
+    /**
+     * @brief Adds a callback function to call with publish is complete
+     *
+     * @param cb Callback function
+     * @return PublishQueueSpiFlashStaticRK&
+     *
+     * The callback is called from loop().
+     */
+    PublishQueueSpiFlashStaticRK &withPublishCompleteUserCallback(PublishCompleteCallback cb) { publishCompleteUserCallback = cb; return *this; };
+
+    /**
+     * @brief Perform setup operations; call this from global application setup()
+     *
+     * This finds the oldest unsent event by reading the sector and record headers.
+     */
+    bool setup();
+
+    /**
+     * @brief Perform application loop operations; call this from global application loop()
+     */
+    void loop();
+
+	/**
+	 * @brief Overload for publishing an event
+	 *
+	 * @param eventName The name of the event (Config::maxEventNameSize maximum).
+	 *
+	 * @param flags1 Normally PRIVATE. You can also use PUBLIC, but one or the other must be specified.
+	 *
+	 * @param flags2 (optional) You can use NO_ACK or WITH_ACK if desired.
+	 *
+	 * @return true if the event was queued or false if it was not.
+	 */
+	inline bool publish(const char *eventName, PublishFlags flags1, PublishFlags flags2 = PublishFlags()) {
+		return publishCommon(eventName, "", flags1, flags2);
+	}
+
+	/**
+	 * @brief Overload for publishing an event
+	 *
+	 * @param eventName The name of the event (Config::maxEventNameSize maximum).
+	 *
+	 * @param data The event data (Config::maxEventDataSize maximum).
+	 *
+	 * @param flags1 Normally PRIVATE. You can also use PUBLIC, but one or the other must be specified.
+	 *
+	 * @param flags2 (optional) You can use NO_ACK or WITH_ACK if desired.
+	 *
+	 * @return true if the event was queued or false if it was not.
+	 */
+	inline bool publish(const char *eventName, const char *data, PublishFlags flags1, PublishFlags flags2 = PublishFlags()) {
+		return publishCommon(eventName, data, flags1, flags2);
+	}
+
+	/**
+	 * @brief Overload for publishing an event
+	 *
+	 * @param eventName The name of the event (Config::maxEventNameSize maximum).
+	 *
+	 * @param data The event data (Config::maxEventDataSize maximum).
+	 *
+	 * @param ttl The time-to-live value. This is ignored by the cloud, so it's not stored in the queue.
+	 * It's accepted for compatibility with PublishQueueSpiFlashRK.
+	 *
+	 * @param flags1 Normally PRIVATE. You can also use PUBLIC, but one or the other must be specified.
+	 *
+	 * @param flags2 (optional) You can use NO_ACK or WITH_ACK if desired.
+	 *
+	 * @return true if the event was queued or false if it was not.
+	 */
+	inline bool publish(const char *eventName, const char *data, int ttl, PublishFlags flags1, PublishFlags flags2 = PublishFlags()) {
+		return publishCommon(eventName, data, flags1, flags2);
+	}
+
+	/**
+	 * @brief Common publish function. All other overloads lead here.
+	 *
+	 * @param eventName The name of the event (Config::maxEventNameSize maximum).
+	 *
+	 * @param data The event data (Config::maxEventDataSize maximum).
+	 *
+	 * @param flags1 Normally PRIVATE. You can also use PUBLIC, but one or the other must be specified.
+	 *
+	 * @param flags2 (optional) You can use NO_ACK or WITH_ACK if desired.
+	 *
+	 * @return true if the event was queued or false if it was not, because it's too large or
+	 * setup() has not been called.
+	 *
+	 * The event is written directly to flash. If it does not fit in the current sector the next
+	 * sector is erased. If the buffer is full, the oldest sector of events is discarded.
+	 */
+	bool publishCommon(const char *eventName, const char *data, PublishFlags flags1, PublishFlags flags2 = PublishFlags());
+
+    /**
+     * @brief Discard all queued events
+     *
+     * This only erases one sector. The earlier sectors are left as-is and will be erased when
+     * they're written to again.
+     */
+    void clearQueues();
+
+    /**
+     * @brief Pause or resume publishing events
+     *
+     * @param value The value to set, true = pause, false = normal operation
+     */
+    void setPausePublishing(bool value) { pausePublishing = value; if (!value && getNumEvents() != 0) { canSleep = false; } };
+
+    /**
+     * @brief Gets the state of the pause publishing flag
+     */
+    bool getPausePublishing() const { return pausePublishing; };
+
+    /**
+     * @brief Determine if it's a good time to go to sleep
+     */
+    bool getCanSleep() const { return canSleep; };
+
+    /**
+     * @brief Gets the total number of events queued
+     *
+     * This is stored in RAM so it does not access the flash. If an event is currently being
+     * sent, the result includes this event.
+     */
+    size_t getNumEvents() const { return numEvents; };
+
+    /**
+     * @brief Locks the mutex that protects shared resources
+     */
+    void lock() { os_mutex_recursive_lock(mutex); };
+
+    /**
+     * @brief Attempts to lock the mutex that protects shared resources
+     *
+     * @return true if the mutex was locked or false if it was busy already.
+     */
+    bool tryLock() { return os_mutex_recursive_trylock(mutex); };
+
+    /**
+     * @brief Unlocks the mutex that protects shared resources
+     */
+    void unlock() { os_mutex_recursive_unlock(mutex); };
+
+    static const size_t SECTOR_SIZE = 4096; //!< Flash sector size in bytes
+
+protected:
+    /**
+     * @brief States for the state machine in loop()
+     */
+    enum State {
+        STATE_CONNECT_WAIT, //!< Waiting to connect to the Particle cloud
+        STATE_WAIT, //!< Waiting to publish
+        STATE_PUBLISH_WAIT //!< Waiting for a publish to complete
+    };
+
+    /**
+     * @brief Header at the beginning of each sector
+     */
+    struct SectorHeader {
+        uint32_t magic; //!< SECTOR_MAGIC
+        uint32_t sequence; //!< Increments for each sector written
+        uint32_t flags; //!< SECTOR_FLAG bits, which are cleared (set to 0) to indicate the condition
+    };
+
+    /**
+     * @brief Header before each event in a sector
+     *
+     * It's followed by the event name and event data, each with a null terminator.
+     */
+    struct RecordHeader {
+        uint16_t size; //!< Size of the event name and data, not including this header. 0xffff is unused space.
+        uint8_t flags; //!< RECORD_FLAG bits, which are cleared (set to 0) to indicate the condition
+        uint8_t eventFlags; //!< EVENT_FLAG bits
+    };
+
+    static const uint32_t SECTOR_MAGIC = 0x5a3c96e1; //!< Magic bytes for SectorHeader
+    static const uint32_t SECTOR_FLAG_CLEAR = 0x01; //!< Cleared if earlier sectors were discarded by a format or clearQueues()
+    static const uint32_t SECTOR_FLAG_ALL_READ = 0x02; //!< Cleared when every event in the sector has been read
+
+    static const uint8_t RECORD_FLAG_COMMITTED = 0x01; //!< Cleared after the record is completely written
+    static const uint8_t RECORD_FLAG_UNREAD = 0x02; //!< Cleared when the event has been published
+
+    static const uint8_t EVENT_FLAG_NO_ACK = 0x01; //!< Event was published with NO_ACK
+    static const uint8_t EVENT_FLAG_WITH_ACK = 0x02; //!< Event was published with WITH_ACK
+
+    static_assert(sizeof(SectorHeader) + sizeof(RecordHeader) + STAGING_SIZE <= SECTOR_SIZE, "maximum event size does not fit in a sector");
+
+    /**
+     * @brief State handler for waiting to connect to the Particle cloud
+     */
+    void stateConnectWait();
+
+    /**
+     * @brief State handler for waiting to publish
+     */
+    void stateWait();
+
+    /**
+     * @brief State handler for waiting for publish to complete
+     */
+    void statePublishWait();
+
+    /**
+     * @brief Completion callback passed to spark_send_event()
+     * 
+     * @param error 0 on success, otherwise a system error code
+     * @param data Not used
+     * @param callbackData The PublishQueueSpiFlashStaticRK object that published the event
+     * @param reserved Not used
+     * 
+     * This is called from the system thread, so it only sets flags checked by statePublishWait().
+     */
+    static void publishCompleteCallback(int error, const void *data, void *callbackData, void *reserved);
+
+    /**
+     * @brief Gets the address of a sector in the flash chip from a sector index
+     */
+    size_t getSectorAddr(size_t sectorIndex) const { return addrStart + sectorIndex * SECTOR_SIZE; };
+
+    /**
+     * @brief Gets the sector index after sectorIndex, wrapping around at the end
+     */
+    size_t getNextSector(size_t sectorIndex) const { return (sectorIndex + 1 < numSectors) ? (sectorIndex + 1) : 0; };
+
+    /**
+     * @brief Gets the sector index before sectorIndex, wrapping around at the beginning
+     */
+    size_t getPrevSector(size_t sectorIndex) const { return (sectorIndex > 0) ? (sectorIndex - 1) : (numSectors - 1); };
+
+    /**
+     * @brief Reads a sector header
+     *
+     * @return true if the sector header has valid magic bytes
+     */
+    bool readSectorHeader(size_t sectorIndex, SectorHeader &sectorHeader);
+
+    /**
+     * @brief Reads a record header
+     *
+     * @return true if there is a record at offset, or false if this is the end of the records in the sector
+     */
+    bool readRecordHeader(size_t sectorIndex, size_t offset, RecordHeader &recordHeader);
+
+    /**
+     * @brief Clears bits in a flags field in flash
+     */
+    void clearFlags(size_t addr, uint8_t flags);
+
+    /**
+     * @brief Erases a sector and makes it the write sector
+     *
+     * @param sectorIndex Sector to write
+     *
+     * @param sectorFlags SECTOR_FLAG bits to clear in the new sector
+     */
+    void startSector(size_t sectorIndex, uint32_t sectorFlags);
+
+    /**
+     * @brief Moves the write position to the next sector, discarding the oldest sector if full
+     */
+    void advanceWriteSector();
+
+    /**
+     * @brief Counts the unread events in a sector, starting at offset
+     *
+     * @return The number of events, and offset is updated to the end of the records in the sector
+     */
+    size_t countUnread(size_t sectorIndex, size_t &offset);
+
+    /**
+     * @brief Reads the oldest unread event into stagingBuf
+     *
+     * @return true if an event was read, false if the queue is empty
+     */
+    bool readEvent();
+
+    /**
+     * @brief Marks the event in stagingBuf as read
+     */
+    void markEventRead();
+
+    /**
+     * @brief Mutex to protect shared resources
+     *
+     * This is initialized in setup() so make sure you call the setup() method from the global application setup.
+     */
+    os_mutex_recursive_t mutex = 0;
+
+    Logger _log; //!< Logger for the app.pubq category
+
+    SpiFlash *spiFlash = nullptr; //!< SpiFlash object to interface with the flash chip
+    size_t addrStart = 0; //!< Address to start in the chip, must be sector aligned
+    size_t addrEnd = 0; //!< Address to end in the chip (exclusive), must be sector aligned
+    size_t numSectors = 0; //!< Number of sectors from addrStart to addrEnd
+
+    size_t readSector = 0; //!< Sector index of the oldest unread event
+    size_t readOffset = 0; //!< Offset in readSector of the oldest unread event
+    size_t writeSector = 0; //!< Sector index currently being written
+    size_t writeOffset = 0; //!< Offset in writeSector to write the next event
+    uint32_t writeSequence = 0; //!< Sequence number of writeSector
+    size_t numEvents = 0; //!< Number of unread events
+
+    State state = STATE_CONNECT_WAIT; //!< State for the state machine in loop()
+    unsigned long stateTime = 0; //!< millis() value when entering the state, used for stateWait
+    unsigned long durationMs = 0; //!< how long to wait before publishing in milliseconds, used in stateWait
+    bool pausePublishing = false; //!< flag to pause publishing (used from automated test)
+    bool canSleep = false; //!< returns true if this is a good time to go to sleep
+
+    bool curEventValid = false; //!< true if stagingBuf contains the event at readSector and readOffset
+    uint8_t curEventFlags = 0; //!< EVENT_FLAG bits for the event in stagingBuf
+    size_t curEventDataOffset = 0; //!< Offset of the event data in stagingBuf
+    volatile bool publishComplete = false; //!< Set by publishCompleteCallback when the publish completes
+    volatile bool publishSuccess = false; //!< Set by publishCompleteCallback if the publish succeeded
+
+    PublishCompleteCallback publishCompleteUserCallback = nullptr; //!< User callback for publish complete
+
+    char stagingBuf[STAGING_SIZE]; //!< Event name and data of the event being published
+};
+
+
+template<class Config>
+bool PublishQueueSpiFlashStaticRK<Config>::setup() {
+    if (system_thread_get_state(nullptr) != spark::feature::ENABLED) {
+        _log.error("SYSTEM_THREAD(ENABLED) is required");
+        return false;
+    }
+    if (!spiFlash) {
+        _log.error("spiFlash is not set");
+        return false;
+    }
+    if ((addrStart % SECTOR_SIZE) != 0 || (addrEnd % SECTOR_SIZE) != 0 || addrEnd < addrStart + 2 * SECTOR_SIZE) {
+        _log.error("addresses must be sector aligned with at least 2 sectors");
+        return false;
+    }
+    numSectors = (addrEnd - addrStart) / SECTOR_SIZE;
+
+    os_mutex_recursive_create(&mutex);
+
+    // Find the most recently written sector
+    bool found = false;
+    for(size_t sectorIndex = 0; sectorIndex < numSectors; sectorIndex++) {
+        SectorHeader sectorHeader;
+        if (readSectorHeader(sectorIndex, sectorHeader)) {
+            if (!found || (int32_t)(sectorHeader.sequence - writeSequence) > 0) {
+                writeSector = sectorIndex;
+                writeSequence = sectorHeader.sequence;
+                found = true;
+            }
+        }
+    }
+    if (!found) {
+        _log.info("formatting");
+        writeSequence = 0;
+        startSector(0, SECTOR_FLAG_CLEAR);
+        readSector = writeSector;
+        readOffset = writeOffset;
+        numEvents = 0;
+        return true;
+    }
+
+    // Walk backward through sectors with consecutive sequence numbers to find the oldest
+    readSector = writeSector;
+    SectorHeader sectorHeader;
+    readSectorHeader(writeSector, sectorHeader);
+    while((sectorHeader.flags & SECTOR_FLAG_CLEAR) != 0) {
+        size_t prevSector = getPrevSector(readSector);
+        if (prevSector == writeSector || !readSectorHeader(prevSector, sectorHeader) || sectorHeader.sequence != writeSequence - (uint32_t)(numSectors + writeSector - prevSector) % numSectors) {
+            break;
+        }
+        readSector = prevSector;
+    }
+
+    // Skip sectors that have been completely read
+    while(readSector != writeSector) {
+        readSectorHeader(readSector, sectorHeader);
+        if ((sectorHeader.flags & SECTOR_FLAG_ALL_READ) != 0) {
+            break;
+        }
+        readSector = getNextSector(readSector);
+    }
+    readOffset = sizeof(SectorHeader);
+
+    // Count the unread events and find the end of the write sector
+    numEvents = 0;
+    for(size_t sectorIndex = readSector; ; sectorIndex = getNextSector(sectorIndex)) {
+        size_t offset = sizeof(SectorHeader);
+        numEvents += countUnread(sectorIndex, offset);
+        if (sectorIndex == writeSector) {
+            writeOffset = offset;
+            break;
+        }
+    }
+
+    _log.info("setup numEvents=%u readSector=%u writeSector=%u", numEvents, readSector, writeSector);
+
+    return true;
+}
+
+template<class Config>
+void PublishQueueSpiFlashStaticRK<Config>::loop() {
+    switch(state) {
+    case STATE_CONNECT_WAIT:
+        stateConnectWait();
+        break;
+
+    case STATE_WAIT:
+        stateWait();
+        break;
+
+    case STATE_PUBLISH_WAIT:
+        statePublishWait();
+        break;
+    }
+}
+
+template<class Config>
+bool PublishQueueSpiFlashStaticRK<Config>::publishCommon(const char *eventName, const char *data, PublishFlags flags1, PublishFlags flags2) {
+    PublishFlags flags = flags1 | flags2;
+
+    if (!data) {
+        data = "";
+    }
+    if (numSectors == 0) {
+        _log.error("setup() has not been called");
+        return false;
+    }
+
+    size_t nameLen = strlen(eventName);
+    size_t dataLen = strlen(data);
+    if (nameLen > Config::maxEventNameSize || dataLen > Config::maxEventDataSize) {
+        _log.error("event %s too large, not queued", eventName);
+        return false;
+    }
+
+    RecordHeader recordHeader;
+    recordHeader.size = (uint16_t)(nameLen + 1 + dataLen + 1);
+    recordHeader.flags = 0xff;
+    recordHeader.eventFlags = 0;
+    if ((flags.value() & NO_ACK.value()) != 0) {
+        recordHeader.eventFlags |= EVENT_FLAG_NO_ACK;
+    }
+    if ((flags.value() & WITH_ACK.value()) != 0) {
+        recordHeader.eventFlags |= EVENT_FLAG_WITH_ACK;
+    }
+
+    WITH_LOCK(*this) {
+        if (writeOffset + sizeof(RecordHeader) + recordHeader.size > SECTOR_SIZE) {
+            advanceWriteSector();
+        }
+
+        // The committed flag is cleared last so a partially written event is ignored after a reset
+        size_t addr = getSectorAddr(writeSector) + writeOffset;
+        spiFlash->writeData(addr, &recordHeader, sizeof(RecordHeader));
+        spiFlash->writeData(addr + sizeof(RecordHeader), eventName, nameLen + 1);
+        spiFlash->writeData(addr + sizeof(RecordHeader) + nameLen + 1, data, dataLen + 1);
+        clearFlags(addr + offsetof(RecordHeader, flags), RECORD_FLAG_COMMITTED);
+
+        writeOffset += sizeof(RecordHeader) + recordHeader.size;
+        numEvents++;
+    }
+    _log.trace("event %s queued", eventName);
+
+    return true;
+}
+
+template<class Config>
+void PublishQueueSpiFlashStaticRK<Config>::clearQueues() {
+    WITH_LOCK(*this) {
+        startSector(getNextSector(writeSector), SECTOR_FLAG_CLEAR);
+        readSector = writeSector;
+        readOffset = writeOffset;
+        numEvents = 0;
+        curEventValid = false;
+    }
+
+    _log.trace("clearQueues");
+}
+
+template<class Config>
+void PublishQueueSpiFlashStaticRK<Config>::stateConnectWait() {
+    canSleep = (pausePublishing || getNumEvents() == 0);
+
+    if (Particle.connected()) {
+        stateTime = millis();
+        durationMs = Config::waitAfterConnectMs;
+        state = STATE_WAIT;
+    }
+}
+
+template<class Config>
+void PublishQueueSpiFlashStaticRK<Config>::stateWait() {
+    if (!Particle.connected()) {
+        state = STATE_CONNECT_WAIT;
+        return;
+    }
+
+    if (pausePublishing) {
+        canSleep = true;
+        return;
+    }
+
+    if (millis() - stateTime < durationMs) {
+        canSleep = (getNumEvents() == 0);
+        return;
+    }
+
+    bool haveEvent;
+    WITH_LOCK(*this) {
+        haveEvent = curEventValid || readEvent();
+    }
+    if (!haveEvent) {
+        // No events, can sleep
+        canSleep = true;
+        return;
+    }
+
+    PublishFlags eventFlags;
+    if ((curEventFlags & EVENT_FLAG_NO_ACK) != 0) {
+        eventFlags |= NO_ACK;
+    }
+    if ((curEventFlags & EVENT_FLAG_WITH_ACK) != 0) {
+        eventFlags |= WITH_ACK;
+    }
+
+    // This message is monitored by the automated test tool. If you edit this, change that too.
+    _log.trace("publishing event=%s data=%s", stagingBuf, &stagingBuf[curEventDataOffset]);
+
+    spark_send_event_data sendData = {};
+    sendData.size = sizeof(spark_send_event_data);
+    sendData.handler_callback = publishCompleteCallback;
+    sendData.handler_data = this;
+
+    publishComplete = false;
+    publishSuccess = false;
+    if (!spark_send_event(stagingBuf, &stagingBuf[curEventDataOffset], 60, (eventFlags | PRIVATE).value(), &sendData)) {
+        // The callback is not called after this returns false
+        publishComplete = true;
+        publishSuccess = false;
+    }
+
+    stateTime = millis();
+    state = STATE_PUBLISH_WAIT;
+    canSleep = false;
+}
+
+template<class Config>
+void PublishQueueSpiFlashStaticRK<Config>::statePublishWait() {
+    if (!publishComplete) {
+        return;
+    }
+
+    bool succeeded = publishSuccess;
+    if (succeeded) {
+        // Remove from the queue
+        _log.trace("publish success");
+
+        WITH_LOCK(*this) {
+            // If the buffer filled while publishing, the event may have already been discarded
+            if (curEventValid) {
+                markEventRead();
+            }
+        }
+        durationMs = Config::waitBetweenPublishMs;
+    }
+    else {
+        // Wait and retry
+        // This message is monitored by the automated test tool. If you edit this, change that too.
+        _log.trace("publish failed");
+        durationMs = Config::waitAfterFailureMs;
+    }
+
+    if (publishCompleteUserCallback) {
+        publishCompleteUserCallback(succeeded, stagingBuf, &stagingBuf[curEventDataOffset]);
+    }
+
+    state = STATE_WAIT;
+    stateTime = millis();
+}
+
+// [static]
+template<class Config>
+void PublishQueueSpiFlashStaticRK<Config>::publishCompleteCallback(int error, const void *data, void *callbackData, void *reserved) {
+    PublishQueueSpiFlashStaticRK *publishQueue = static_cast<PublishQueueSpiFlashStaticRK *>(callbackData);
+    publishQueue->publishSuccess = (error == 0);
+    publishQueue->publishComplete = true;
+}
+
+template<class Config>
+bool PublishQueueSpiFlashStaticRK<Config>::readSectorHeader(size_t sectorIndex, SectorHeader &sectorHeader) {
+    spiFlash->readData(getSectorAddr(sectorIndex), &sectorHeader, sizeof(SectorHeader));
+    return sectorHeader.magic == SECTOR_MAGIC;
+}
+
+template<class Config>
+bool PublishQueueSpiFlashStaticRK<Config>::readRecordHeader(size_t sectorIndex, size_t offset, RecordHeader &recordHeader) {
+    if (offset + sizeof(RecordHeader) > SECTOR_SIZE) {
+        return false;
+    }
+    spiFlash->readData(getSectorAddr(sectorIndex) + offset, &recordHeader, sizeof(RecordHeader));
+    if (recordHeader.size == 0xffff || offset + sizeof(RecordHeader) + recordHeader.size > SECTOR_SIZE) {
+        // Unused space, or a header corrupted by a reset while writing it
+        return false;
+    }
+    return true;
+}
+
+template<class Config>
+void PublishQueueSpiFlashStaticRK<Config>::clearFlags(size_t addr, uint8_t flags) {
+    // Bits can be cleared in NOR flash without erasing, and programming a 1 bit leaves it unchanged
+    uint8_t value = (uint8_t) ~flags;
+    spiFlash->writeData(addr, &value, sizeof(value));
+}
+
+template<class Config>
+void PublishQueueSpiFlashStaticRK<Config>::startSector(size_t sectorIndex, uint32_t sectorFlags) {
+    SectorHeader sectorHeader;
+    sectorHeader.magic = SECTOR_MAGIC;
+    sectorHeader.sequence = ++writeSequence;
+    sectorHeader.flags = ~sectorFlags;
+
+    spiFlash->sectorErase(getSectorAddr(sectorIndex));
+    spiFlash->writeData(getSectorAddr(sectorIndex), &sectorHeader, sizeof(SectorHeader));
+
+    writeSector = sectorIndex;
+    writeOffset = sizeof(SectorHeader);
+}
+
+template<class Config>
+void PublishQueueSpiFlashStaticRK<Config>::advanceWriteSector() {
+    size_t nextSector = getNextSector(writeSector);
+    if (nextSector == readSector) {
+        // Buffer is full, discard the oldest sector
+        size_t offset = readOffset;
+        size_t discarded = countUnread(readSector, offset);
+        numEvents -= (discarded < numEvents) ? discarded : numEvents;
+
+        readSector = getNextSector(readSector);
+        readOffset = sizeof(SectorHeader);
+        curEventValid = false;
+
+        _log.info("buffer full, discarded %u events", discarded);
+    }
+    startSector(nextSector, 0);
+}
+
+template<class Config>
+size_t PublishQueueSpiFlashStaticRK<Config>::countUnread(size_t sectorIndex, size_t &offset) {
+    size_t count = 0;
+    RecordHeader recordHeader;
+    while(readRecordHeader(sectorIndex, offset, recordHeader)) {
+        if ((recordHeader.flags & (RECORD_FLAG_COMMITTED | RECORD_FLAG_UNREAD)) == RECORD_FLAG_UNREAD) {
+            count++;
+        }
+        offset += sizeof(RecordHeader) + recordHeader.size;
+    }
+    if (offset + sizeof(RecordHeader) <= SECTOR_SIZE && recordHeader.size != 0xffff) {
+        // Corrupted record header, don't write after it
+        offset = SECTOR_SIZE;
+    }
+    return count;
+}
+
+template<class Config>
+bool PublishQueueSpiFlashStaticRK<Config>::readEvent() {
+    while(true) {
+        RecordHeader recordHeader;
+        if (!readRecordHeader(readSector, readOffset, recordHeader)) {
+            if (readSector == writeSector) {
+                return false;
+            }
+            // Finished with this sector so setup() can skip it
+            clearFlags(getSectorAddr(readSector) + offsetof(SectorHeader, flags), SECTOR_FLAG_ALL_READ);
+
+            readSector = getNextSector(readSector);
+            readOffset = sizeof(SectorHeader);
+            continue;
+        }
+
+        if ((recordHeader.flags & (RECORD_FLAG_COMMITTED | RECORD_FLAG_UNREAD)) == RECORD_FLAG_UNREAD && recordHeader.size <= STAGING_SIZE) {
+            spiFlash->readData(getSectorAddr(readSector) + readOffset + sizeof(RecordHeader), stagingBuf, recordHeader.size);
+            stagingBuf[recordHeader.size - 1] = 0;
+
+            curEventFlags = recordHeader.eventFlags;
+            curEventDataOffset = strnlen(stagingBuf, recordHeader.size - 1) + 1;
+            if (curEventDataOffset >= recordHeader.size) {
+                curEventDataOffset = recordHeader.size - 1;
+            }
+            curEventValid = true;
+            return true;
+        }
+
+        // Already read or partially written
+        readOffset += sizeof(RecordHeader) + recordHeader.size;
+    }
+}
+
+template<class Config>
+void PublishQueueSpiFlashStaticRK<Config>::markEventRead() {
+    clearFlags(getSectorAddr(readSector) + readOffset + offsetof(RecordHeader, flags), RECORD_FLAG_COMMITTED | RECORD_FLAG_UNREAD);
+
+    RecordHeader recordHeader;
+    readRecordHeader(readSector, readOffset, recordHeader);
+    readOffset += sizeof(RecordHeader) + recordHeader.size;
+
+    if (numEvents > 0) {
+        numEvents--;
+    }
+    curEventValid = false;
+}
+
+#endif  /* __PUBLISHQUEUESPIFLASHSTATICRK_H */